@@ -0,0 +1,65 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Append-only storage for objects that are referred to by dense ids.
+// Objects live in fixed-size chunks, so the id -> object lookup is a shift and
+// a mask, and the address of an object never changes as the arena grows.
+template <typename T, unsigned ChunkBits = 10> class Arena {
+  static constexpr uint32_t ChunkSize = 1U << ChunkBits;
+  static constexpr uint32_t ChunkMask = ChunkSize - 1;
+
+  std::vector<T *> chunks;
+  uint32_t count = 0;
+
+  static T *allocateChunk() {
+    return static_cast<T *>(::operator new(sizeof(T) * ChunkSize,
+                                           std::align_val_t(alignof(T))));
+  }
+
+  static void deallocateChunk(T *chunk) {
+    ::operator delete(chunk, std::align_val_t(alignof(T)));
+  }
+
+public:
+  Arena() = default;
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  ~Arena() {
+    for (uint32_t i = 0; i < count; i++)
+      (*this)[i].~T();
+    for (T *chunk : chunks)
+      deallocateChunk(chunk);
+  }
+
+  template <typename... ArgTypes> T &emplace_back(ArgTypes &&...args) {
+    if ((count & ChunkMask) == 0 && (count >> ChunkBits) == chunks.size())
+      chunks.push_back(allocateChunk());
+    T *slot = chunks[count >> ChunkBits] + (count & ChunkMask);
+    new (slot) T(std::forward<ArgTypes>(args)...);
+    count++;
+    return *slot;
+  }
+
+  T &operator[](uint32_t id) {
+    assert(id < count);
+    return chunks[id >> ChunkBits][id & ChunkMask];
+  }
+
+  const T &operator[](uint32_t id) const {
+    assert(id < count);
+    return chunks[id >> ChunkBits][id & ChunkMask];
+  }
+
+  uint32_t size() const { return count; }
+  bool empty() const { return count == 0; }
+};
+
+#endif // ARENA_H
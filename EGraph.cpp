@@ -45,10 +45,6 @@ void EClassBase::absorb(EClassBase *other) {
   absorbMap(uses, other->uses);
   users.insert(other->users.begin(), other->users.end());
   other->users.clear();
-  other->leader = this;
-  if (rank == other->rank)
-    rank++;
-  assert(other->getLeader() == this);
 }
 
 llvm::DenseSet<ENode *> *EClassBase::getUsersByUses(Opcode opcode,
@@ -66,45 +62,45 @@ llvm::DenseSet<ENode *> *EClassBase::getNodesByOpcode(Opcode opcode) {
   return nullptr;
 }
 
-NodeKey EGraphBase::canonicalize(Opcode opcode, llvm::ArrayRef<EClassBase *> operands) {
-  NodeKey key;
-  key.opcode = opcode;
-  for (EClassBase *c : operands)
-    key.operands.push_back(getLeader(c));
-  return key;
+ENode *EGraphBase::findCanonicalNode(Opcode opcode,
+                                     llvm::ArrayRef<ClassId> operands) {
+  unsigned hash = decltype(nodes)::hash(opcode, operands);
+  if (ENode *node = nodes.find(opcode, operands, hash))
+    return node;
+  // Copy the operands into the arena so that the node doesn't own any memory
+  ClassId *storage = operandArena.Allocate<ClassId>(operands.size());
+  std::copy(operands.begin(), operands.end(), storage);
+  ENode *node = &nodeArena.emplace_back(
+      nodeArena.size(), opcode,
+      llvm::makeArrayRef(storage, operands.size()), hash);
+  nodes.insert(node);
+  return node;
 }
 
-ENode *EGraphBase::findNode(NodeKey key) {
-  auto [it, inserted] = nodes.try_emplace(key);
-  if (inserted) {
-    assert(!it->second);
-    it->second.reset(new ENode(key.opcode, key.operands));
-  }
-  return it->second.get();
+ENode *EGraphBase::findNode(Opcode opcode, llvm::ArrayRef<ClassId> operands) {
+  llvm::SmallVector<ClassId, 4> canonical;
+  for (ClassId c : operands)
+    canonical.push_back(unionFind.find(c));
+  return findCanonicalNode(opcode, canonical);
 }
 
 ENode *EGraphBase::findNode(Opcode opcode, llvm::ArrayRef<EClassBase *> operands) {
-  return findNode(canonicalize(opcode, operands));
+  llvm::SmallVector<ClassId, 4> canonical;
+  for (EClassBase *c : operands)
+    canonical.push_back(unionFind.find(c->getId()));
+  return findCanonicalNode(opcode, canonical);
 }
 
-void EClassBase::repairUserSets(llvm::ArrayRef<Replacement> repls) {
-  // Fix the use index by replacing the duplicated user
-  // with their new canonical user
-  for (auto &repl : repls) {
+void EClassBase::replaceUsers(const Replacement &repl, unsigned operandId) {
+  auto replace = [&](llvm::DenseSet<ENode *> &nodes) {
     bool erased = false;
     for (auto *node : repl.from)
-      erased |= users.erase(node);
+      erased |= nodes.erase(node);
     if (erased)
-      users.insert(repl.to);
-  }
+      nodes.insert(repl.to);
+  };
 
-  for (auto &nodes : llvm::make_second_range(uses)) {
-    for (auto &repl : repls) {
-      bool erased = false;
-      for (auto *node : repl.from)
-        erased |= nodes.erase(node);
-      if (erased)
-        nodes.insert(repl.to);
-    }
-  }
+  replace(users);
+  if (auto *nodes = getUsersByUses(repl.to->getOpcode(), operandId))
+    replace(*nodes);
 }
@@ -1,41 +1,61 @@
 #ifndef EGRAPH_H
 #define EGRAPH_H
 
+#include "Arena.h"
+#include "HashCons.h"
+#include "UnionFind.h"
 #include "llvm/ADT/ArrayRef.h"
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/SmallVector.h"
+#include "llvm/Support/Allocator.h"
 #include "llvm/Support/raw_ostream.h"
 
 using llvm::errs;
 
+#include <type_traits>
 #include <vector>
 
 using Opcode = unsigned;
 
+// Nodes and classes live in arenas owned by the e-graph and are numbered
+// densely in creation order.
+using ClassId = uint32_t;
+using NodeId = uint32_t;
+
+constexpr ClassId InvalidClassId = ~0U;
+
 class EClassBase;
 class ENode {
-  friend class ENodeHashInfo;
   Opcode opcode;
-  llvm::SmallVector<EClassBase *, 3> operands;
-  EClassBase *cls;
+  unsigned numOperands;
+  // Canonical (at creation time) operand classes, allocated from the
+  // e-graph's operand arena
+  const ClassId *operands;
+  ClassId cls;
+  NodeId id;
+  // Hash of <opcode, operands>, cached for the hashcons
+  unsigned hash;
 
 public:
-  ENode(Opcode opcode, llvm::ArrayRef<EClassBase *> operands)
-      : opcode(opcode), operands(operands.begin(), operands.end()),
-        cls(nullptr) {}
-  llvm::ArrayRef<EClassBase *> getOperands() const { return operands; }
-  decltype(operands)::iterator operand_begin() { return operands.begin(); }
-  decltype(operands)::iterator operand_end() { return operands.end(); }
+  ENode(NodeId id, Opcode opcode, llvm::ArrayRef<ClassId> operands,
+        unsigned hash)
+      : opcode(opcode), numOperands(operands.size()),
+        operands(operands.data()), cls(InvalidClassId), id(id), hash(hash) {}
+  llvm::ArrayRef<ClassId> getOperands() const {
+    return llvm::makeArrayRef(operands, numOperands);
+  }
+  const ClassId *operand_begin() const { return operands; }
+  const ClassId *operand_end() const { return operands + numOperands; }
   Opcode getOpcode() const { return opcode; }
-  void setClass(EClassBase *cls2) { cls = cls2; }
-  EClassBase *getClass() const { return cls; }
+  NodeId getId() const { return id; }
+  unsigned getHash() const { return hash; }
+  void setClassId(ClassId cls2) { cls = cls2; }
+  ClassId getClassId() const { return cls; }
 };
 
 class EClassBase {
-  EClassBase *leader;
-  // For union by rank
-  unsigned rank;
+  ClassId id;
 
 protected:
   // Mapping <user opcode, operand id> -> <sorted array of of user>
@@ -49,23 +69,15 @@ protected:
     ENode *to;
   };
 
-  void repairUserSets(llvm::ArrayRef<Replacement>);
+  // Replace the users in `repl.from` with `repl.to`, all of which use this
+  // class as their `operandId`th operand
+  void replaceUsers(const Replacement &repl, unsigned operandId);
 
 public:
-  EClassBase() : rank(0), leader(this) {}
+  EClassBase(ClassId id) : id(id) {}
   EClassBase &operator=(EClassBase &&) = default;
 
-  bool isLeader() const { return leader == this; }
-
-  unsigned getRank() const { return rank; }
-
-  EClassBase *getLeader() {
-    if (isLeader() || leader->isLeader())
-      return leader;
-    // Path compression
-    leader = leader->getLeader();
-    return leader;
-  }
+  ClassId getId() const { return id; }
 
   void addNode(ENode *node);
   // Record that fact that `user`'s `i`th operand is `this` EClassBase
@@ -85,42 +97,39 @@ template <typename EGraphT> class EClass : public EClassBase {
   friend class EGraph<EGraphT>;
   typename EGraphT::AnalysisData data;
 
+  // Replace the nodes of this class by their canonical versions and merge
+  // the classes that turn out to share one of them with this class
+  void canonicalizeNodes(EGraph<EGraphT> *g);
+
 public:
+  EClass(ClassId id) : EClassBase(id) {}
   void repair(EGraph<EGraphT> *g);
 };
 
-struct NodeKey {
-  Opcode opcode;
-  llvm::SmallVector<EClassBase *, 3> operands;
-};
-
-struct NodeHashInfo {
-  static NodeKey getEmptyKey() { return NodeKey{~0U, {}}; }
-  static NodeKey getTombstoneKey() { return NodeKey{~1U, {}}; }
-  static bool isEqual(const NodeKey &node1, const NodeKey &node2) {
-    if (node1.opcode != node2.opcode)
-      return false;
-    if (node1.operands.size() != node2.operands.size())
-      return false;
-    for (auto [o1, o2] : llvm::zip(node1.operands, node2.operands)) {
-      if (o1 != o2)
-        return false;
-    }
-    return true;
-  }
-  static unsigned getHashValue(const NodeKey &node) {
-    return llvm::hash_combine(
-        llvm::hash_value(node.opcode),
-        llvm::hash_combine_range(node.operands.begin(), node.operands.end()));
-  }
-};
-
 class EGraphBase {
 protected:
-  llvm::DenseMap<NodeKey, std::unique_ptr<ENode>, NodeHashInfo> nodes;
-  std::vector<std::unique_ptr<EClassBase>> classes;
+  // The hashcons, mapping <opcode, canonical operands> -> node
+  HashCons<ENode> nodes;
+  // Backing storage of the nodes, indexed by NodeId
+  Arena<ENode> nodeArena;
+  llvm::BumpPtrAllocator operandArena;
+  // Mapping ClassId -> class. The classes themselves live in an arena owned
+  // by the (typed) EGraph.
+  std::vector<EClassBase *> classes;
+  // Equivalence relation over ClassIds
+  UnionFind unionFind;
   // List of e-classs that require repair
   std::vector<EClassBase *> repairList;
+  // Mapping ClassId -> the epoch in which the class was last created, merged
+  // into, or repaired. Only meaningful for leaders.
+  std::vector<unsigned> modifiedEpochs;
+  unsigned epoch = 0;
+  // Number of leader classes
+  unsigned numLeaders = 0;
+  // Number of (non-trivial) merges so far
+  unsigned mergeCount = 0;
+
+  void touch(ClassId id) { modifiedEpochs[id] = epoch; }
 
   using ec_iterator = decltype(classes)::iterator;
   using class_ptr = EClassBase *;
@@ -133,20 +142,19 @@ public:
                                   std::ptrdiff_t, class_ptr *, class_ptr &>;
 
   class class_iterator : public class_iterator_base {
-    std::vector<std::unique_ptr<EClassBase>> &classes;
+    EGraphBase &g;
 
     void skipEmptyClasses() {
-      while (I != classes.end() && !(*I)->isLeader())
+      while (I != g.classes.end() && !g.isLeader(*I))
         ++I;
     }
 
   public:
-    class_iterator(std::vector<std::unique_ptr<EClassBase>> &classes,
-                   ec_iterator it)
-        : class_iterator_base(it), classes(classes) {
+    class_iterator(EGraphBase &g, ec_iterator it)
+        : class_iterator_base(it), g(g) {
       skipEmptyClasses();
     }
-    class_ptr operator*() const { return I->get(); }
+    class_ptr operator*() const { return *I; }
     class_iterator &operator++() {
       ++I;
       skipEmptyClasses();
@@ -155,19 +163,54 @@ public:
   };
 
   class_iterator class_begin() {
-    return class_iterator(classes, classes.begin());
+    return class_iterator(*this, classes.begin());
   }
 
-  class_iterator class_end() { return class_iterator(classes, classes.end()); }
+  class_iterator class_end() { return class_iterator(*this, classes.end()); }
 
-  NodeKey canonicalize(Opcode opcode, llvm::ArrayRef<EClassBase *> operands);
-  EClassBase *getLeader(EClassBase *c) const { return c->getLeader(); }
+  // The leaders among the classes with ids in [begin, end)
+  llvm::iterator_range<class_iterator> classRange(ClassId begin, ClassId end) {
+    assert(begin <= end && end <= classes.size());
+    return llvm::make_range(class_iterator(*this, classes.begin() + begin),
+                            class_iterator(*this, classes.begin() + end));
+  }
+
+  // Upper bound of the class ids
+  ClassId numClassIds() const { return classes.size(); }
+  // Upper bound of the node ids
+  NodeId numNodeIds() const { return nodeArena.size(); }
+
+  // The accessors below never write to the e-graph (in particular they don't
+  // compress the paths of the union-find), so they can be used by concurrent
+  // readers such as the match phase.
+  EClassBase *getClass(ClassId id) const { return classes[id]; }
+  ENode *getNode(NodeId id) { return &nodeArena[id]; }
+  ClassId getLeaderId(ClassId id) const { return unionFind.find(id); }
+  EClassBase *getLeader(ClassId id) const { return classes[unionFind.find(id)]; }
+  EClassBase *getLeader(EClassBase *c) const { return getLeader(c->getId()); }
+  bool isLeader(EClassBase *c) const { return unionFind.isRoot(c->getId()); }
+  // Return the node <opcode, canonicalized operands>, creating it if needed
+  ENode *findNode(Opcode opcode, llvm::ArrayRef<ClassId> operands);
   ENode *findNode(Opcode opcode, llvm::ArrayRef<EClassBase *> operands);
-  ENode *findNode(NodeKey);
+  // Same as `findNode` but assumes the operands are already canonical
+  ENode *findCanonicalNode(Opcode opcode, llvm::ArrayRef<ClassId> operands);
   bool isEquivalent(EClassBase *c1, EClassBase *c2) const {
-    return getLeader(c1) == getLeader(c2);
+    return isEquivalent(c1->getId(), c2->getId());
+  }
+  bool isEquivalent(ClassId c1, ClassId c2) const {
+    return unionFind.find(c1) == unionFind.find(c2);
   }
   unsigned numNodes() const { return nodes.size(); }
+  unsigned numClasses() const { return numLeaders; }
+  unsigned numMerges() const { return mergeCount; }
+  unsigned getEpoch() const { return epoch; }
+  // Start a new epoch, so that later changes can be told apart from the
+  // current ones. Return the new epoch.
+  unsigned advanceEpoch() { return ++epoch; }
+  // Return if `c` has changed in epoch `since` or later
+  bool isModifiedSince(EClassBase *c, unsigned since) const {
+    return modifiedEpochs[getLeaderId(c->getId())] >= since;
+  }
   virtual void dump() {}
   virtual void dump(ENode *) {}
   virtual void dump(EClassBase *) {}
@@ -175,8 +218,16 @@ public:
 };
 
 template <typename EGraphT> class EGraph : public EGraphBase {
+  friend class EClass<EGraphT>;
+  Arena<EClass<EGraphT>> classArena;
+
   EClassBase *newClass() {
-    return classes.emplace_back(new EClass<EGraphT>()).get();
+    auto &c = classArena.emplace_back(unionFind.makeSet());
+    classes.push_back(&c);
+    modifiedEpochs.push_back(epoch);
+    numLeaders++;
+    assert(classes.size() == unionFind.size());
+    return &c;
   }
 
 protected:
@@ -191,18 +242,19 @@ public:
   auto getData(EClassBase *c) {
     return static_cast<EClass<EGraphT> *>(c)->data;
   }
+  auto getData(ClassId id) { return getData(getClass(id)); }
 
   EClassBase *make(Opcode opcode,
                    llvm::ArrayRef<EClassBase *> operands = llvm::None) {
     ENode *node = findNode(opcode, operands);
-    if (auto *c = node->getClass())
-      return c;
+    if (node->getClassId() != InvalidClassId)
+      return getClass(node->getClassId());
 
     EClassBase *c = newClass();
-    node->setClass(c);
+    node->setClassId(c->getId());
     c->addNode(node);
     for (auto item : llvm::enumerate(node->getOperands()))
-      item.value()->addUse(node, item.index());
+      getClass(item.value())->addUse(node, item.index());
 
     // Run analysis on the new node
     setData(c, analysis()->analyze(node));
@@ -218,9 +270,12 @@ public:
     if (c1 == c2)
       return c1;
 
-    assert(c1->isLeader() && c2->isLeader());
+    assert(isLeader(c1) && isLeader(c2));
 
-    if (c1->getRank() < c2->getRank()) {
+    // Union by size: the larger set stays the leader
+    numLeaders--;
+    mergeCount++;
+    if (unionFind.unite(c1->getId(), c2->getId()) != c1->getId()) {
       std::swap(c1, c2);
     }
 
@@ -229,6 +284,7 @@ public:
     auto newData = analysis()->join(getData(c1), getData(c2));
     // Merge everything into c1
     c1->absorb(c2);
+    touch(c1->getId());
     // See if we can merge some of `c`'s users later
     repairList.push_back(c1);
     // Update the joined analysis result
@@ -237,9 +293,8 @@ public:
   }
 
   void rebuild() {
-    for (auto *c : llvm::make_range(class_begin(), class_end()))
-      static_cast<EClass<EGraphT> *>(c)->repair(this);
-
+    // Only the classes touched by merges since the last rebuild (and,
+    // transitively, the classes whose analysis data changed) get repaired
     while (!repairList.empty()) {
       llvm::DenseSet<EClassBase *> todo;
       for (auto *c : repairList)
@@ -251,7 +306,7 @@ public:
 
         analysis()->modify(c);
         for (ENode *user : c->getUsers()) {
-          auto *userClass = user->getClass();
+          auto *userClass = getClass(user->getClassId());
           auto oldData = getData(userClass);
           auto newData = analysis()->join(oldData, analysis()->analyze(user));
           if (newData != oldData) {
@@ -264,11 +319,11 @@ public:
         // Check that the nodes are either canonical or we are about to repair their children
         for (auto &nodes : llvm::make_second_range(c->getNodes())) {
           for (auto *node : nodes) {
-            for (auto *o : node->getOperands()) {
+            for (ClassId o : node->getOperands()) {
               auto equivalent = [&](auto *c2) {
-                return c2->getLeader() == o->getLeader();
+                return isEquivalent(c2->getId(), o);
               };
-              assert(o->isLeader() ||
+              assert(unionFind.isRoot(o) ||
                   llvm::any_of(repairList, equivalent) ||
                   std::any_of(std::next(it), end, equivalent));
             }
@@ -303,18 +358,29 @@ public:
   }
 };
 
-template <typename EGraphT> void EClass<EGraphT>::repair(EGraph<EGraphT> *g) {
-  assert(isLeader());
+template <typename EGraphT>
+void EClass<EGraphT>::canonicalizeNodes(EGraph<EGraphT> *g) {
+  // Only the classes on the worklist get here, so nothing else is going to
+  // notice that a canonical node is shared with another class, or that the
+  // operands still list the stale node as their user
+  llvm::SmallVector<ClassId, 2> congruentClasses;
   for (auto &nodes : llvm::make_second_range(opcodeToNodesMap)) {
     llvm::DenseSet<ENode *> canonNodes;
     for (auto *n : nodes) {
-      auto key = g->canonicalize(n->getOpcode(), n->getOperands());
-      auto *n2 = g->findNode(key);
-      n2->setClass(this);
-      assert(all_of(n2->getOperands(), [&](auto *o) {
-        return any_of(o->getLeader()->getUsers(), [&](auto *user) {
-          if (g->findNode(g->canonicalize(user->getOpcode(),
-                                             user->getOperands())) == n2) {
+      auto *n2 = g->findNode(n->getOpcode(), n->getOperands());
+      if (n2->getClassId() != InvalidClassId &&
+          !g->isEquivalent(n2->getClassId(), getId()))
+        congruentClasses.push_back(n2->getClassId());
+      n2->setClassId(getId());
+      if (n2 != n) {
+        Replacement rep{{n}, n2};
+        for (auto item : llvm::enumerate(n2->getOperands()))
+          static_cast<EClass<EGraphT> *>(g->getLeader(item.value()))
+              ->replaceUsers(rep, item.index());
+      }
+      assert(all_of(n2->getOperands(), [&](ClassId o) {
+        return any_of(g->getLeader(o)->getUsers(), [&](auto *user) {
+          if (g->findNode(user->getOpcode(), user->getOperands()) == n2) {
           return true;
           }
           return false;
@@ -324,42 +390,60 @@ template <typename EGraphT> void EClass<EGraphT>::repair(EGraph<EGraphT> *g) {
     }
     nodes = std::move(canonNodes);
   }
+  for (ClassId c : congruentClasses)
+    g->merge(this, g->getClass(c));
+}
+
+template <typename EGraphT> void EClass<EGraphT>::repair(EGraph<EGraphT> *g) {
+  assert(g->isLeader(this));
+  canonicalizeNodes(g);
+
+  // Take the users out of this class: merging duplicated users below can make
+  // this class absorb (or be absorbed into) another class, whose users must
+  // survive the repair.
+  auto oldUsers = std::move(users);
+  users.clear();
+  uses.clear();
 
   // Group users together by their canonical representation
-  llvm::DenseMap<NodeKey, std::vector<ENode *>, NodeHashInfo> uniqueUsers;
-  for (ENode *user : users) {
-    auto key = g->canonicalize(user->getOpcode(), user->getOperands());
-    uniqueUsers[key].push_back(user);
-  }
+  llvm::DenseMap<ENode *, std::vector<ENode *>> uniqueUsers;
+  for (ENode *user : oldUsers)
+    uniqueUsers[g->findNode(user->getOpcode(), user->getOperands())]
+        .push_back(user);
 
   // Remember the nodes that we are replacing
   std::vector<Replacement> repls;
   llvm::DenseSet<ENode *> newUsers;
   // Merge and remove the duplicated users
   decltype(uses) newUses;
-  for (auto kv : uniqueUsers) {
-    NodeKey key = kv.first;
+  for (auto &kv : uniqueUsers) {
+    ENode *user = kv.first;
     auto &nodes = kv.second;
     // if (nodes.size() <= 1)
     // continue;
 
     ENode *node0 = nodes.front();
-    auto *c = node0->getClass();
-    assert(c);
-    ENode *user = g->findNode(key);
+    assert(node0->getClassId() != InvalidClassId);
+    auto *c = g->getClass(node0->getClassId());
 
     auto &rep = repls.emplace_back();
     rep.to = user;
     rep.from.push_back(node0);
     for (auto *node : llvm::drop_begin(nodes)) {
-      assert(node->getClass());
-      g->merge(c, node->getClass());
+      assert(node->getClassId() != InvalidClassId);
+      g->merge(c, g->getClass(node->getClassId()));
       rep.from.push_back(node);
     }
+    // The canonical node may already live in another class
+    if (user->getClassId() != InvalidClassId)
+      g->merge(c, g->getClass(user->getClassId()));
 
-    c = c->getLeader();
+    c = g->getLeader(c);
+    // `c` has a new canonical node
+    if (rep.from.size() > 1 || node0 != user)
+      g->touch(c->getId());
 
-    user->setClass(c);
+    user->setClassId(c->getId());
     newUsers.insert(user);
     //users.insert(user);
 
@@ -372,15 +456,20 @@ template <typename EGraphT> void EClass<EGraphT>::repair(EGraph<EGraphT> *g) {
 
     auto userOperands = user->getOperands();
     for (unsigned i = 0; i < userOperands.size(); i++) {
-      if (g->isEquivalent(userOperands[i], this))
+      if (g->isEquivalent(userOperands[i], getId()))
         newUses[std::make_pair(user->getOpcode(), i)].insert(user);
+      else
+        // The other operand classes are not necessarily going to be
+        // repaired, so fix their user sets now
+        static_cast<EClass<EGraphT> *>(g->getLeader(userOperands[i]))
+            ->replaceUsers(rep, i);
     }
-
-    //for (auto *operand : user->getOperands())
-    //  static_cast<EClass<EGraphT> *>(g->getLeader(operand))->repairUserSets(repls);
   }
-  users = std::move(newUsers);
-  uses = std::move(newUses);
+  auto *leader = static_cast<EClass<EGraphT> *>(g->getLeader(this));
+  g->touch(leader->getId());
+  leader->users.insert(newUsers.begin(), newUsers.end());
+  for (auto &kv : newUses)
+    leader->uses[kv.first].insert(kv.second.begin(), kv.second.end());
 }
 
 struct NullAnalysis {
@@ -393,4 +482,54 @@ struct NullAnalysis {
 // EGraph without analysis
 struct BasicEGraph : public EGraph<BasicEGraph>, NullAnalysis {};
 
+// Analysis data of a ProductAnalysis
+template <typename DataA, typename DataB> struct ProductData {
+  DataA first;
+  DataB second;
+  bool operator==(const ProductData &other) const {
+    return first == other.first && second == other.second;
+  }
+  bool operator!=(const ProductData &other) const { return !(*this == other); }
+};
+
+// Return the part of the analysis data of a class (`data`, as returned by
+// getData()) that belongs to the analysis whose own data has type `T`: all of
+// it, or a part of a ProductData. Nested products go on the right.
+template <typename T, typename DataT> T getAnalysisData(const DataT &data) {
+  if constexpr (std::is_same_v<T, DataT>)
+    return data;
+  else if constexpr (std::is_same_v<T, decltype(data.first)>)
+    return data.first;
+  else
+    return getAnalysisData<T>(data.second);
+}
+
+// Run the analyses `A` and `B` side by side, e.g., to keep the cheapest term of
+// every class of a language that has an analysis of its own:
+//
+//   struct G : public EGraph<G>,
+//              ProductAnalysis<G, ConstantFolding<G>, CostAnalysis<G>> {};
+//
+// Both analyses have to read their data with getAnalysisData(). `A` modifies
+// a class first, `B` then gets the class it may have been merged into.
+template <typename EGraphT, typename A, typename B>
+class ProductAnalysis : public A, public B {
+  EGraphT &graph() { return *static_cast<EGraphT *>(this); }
+
+public:
+  using AnalysisData =
+      ProductData<typename A::AnalysisData, typename B::AnalysisData>;
+
+  AnalysisData analyze(ENode *node) {
+    return {A::analyze(node), B::analyze(node)};
+  }
+  AnalysisData join(AnalysisData a, AnalysisData b) {
+    return {A::join(a.first, b.first), B::join(a.second, b.second)};
+  }
+  void modify(EClassBase *c) {
+    A::modify(c);
+    B::modify(graph().getLeader(c));
+  }
+};
+
 #endif // EGRAPH_H
@@ -1,57 +1,269 @@
 #include "Extractor.h"
 #include "EGraph.h"
 #include "llvm/Support/raw_ostream.h"
+#include <chrono>
+#include <limits>
+#include <deque>
 
 using llvm::errs;
 
-Extractor::~Extractor() {}
+static constexpr Extractor::Cost Infinity =
+    std::numeric_limits<Extractor::Cost>::infinity();
 
-Extractor::Result Extractor::extract(EClassBase *c) {
-  llvm::DenseMap<ENode *, Cost> totalCosts;
-  // Figure out the total cost of using a given node;
-  std::function<Cost (ENode *)> totalCostOf = [&](ENode *node) -> Cost {
-    // Insert a null cost to avoid infinite loop for circular nodes/classes
-    auto [it, inserted] = totalCosts.try_emplace(node, 0);
-    if (!inserted)
-      return it->second;
-    Cost cost = costOf(node);
-    for (auto *o : node->getOperands()) {
-      Cost bestCost = -1;
-      for (auto &childNodes : llvm::make_second_range(o->getLeader()->getNodes())) {
-        for (auto *n2 : childNodes) {
-          Cost childCost = totalCostOf(n2);
-          if (bestCost < 0 || childCost < bestCost)
-            bestCost = childCost;
+Extractor::Cost
+Extractor::getTreeCost(const ENode *node,
+                       llvm::ArrayRef<Cost> classCosts) const {
+  Cost operandsCost = 0;
+  for (ClassId o : node->getOperands())
+    operandsCost =
+        model.addOperandCost(operandsCost, classCosts[g.getLeaderId(o)]);
+  return costOf(node) + operandsCost;
+}
+
+// Compute the cheapest node of every class reachable from `roots` bottom-up,
+// with a worklist of nodes. A node is first costed once all of its operand
+// classes have a cost, so it's never costed against an infinite operand. A
+// class that gets cheaper after that, because a cheaper node of it became
+// ready later, has its costed users costed again. The worklist is FIFO, so
+// the nodes are costed roughly by depth and a cheaper node usually arrives
+// before the users of its class. Cycles are never cheaper than the paths that
+// lead into them, so they don't need special treatment. Ties go to the lowest
+// node id.
+std::vector<ENode *>
+Extractor::findBestNodes(llvm::ArrayRef<ClassId> roots,
+                         std::vector<Cost> &bestCosts) {
+  std::deque<ENode *> worklist;
+
+  // Collect the reachable classes and, for each of them, the nodes using it
+  // (the parent edges along which costs are propagated). Nodes are indexed by
+  // id, which can be larger than the number of live nodes.
+  std::vector<llvm::SmallVector<ENode *, 4>> parents(g.numClassIds());
+  std::vector<bool> reachable(g.numClassIds(), false);
+  // Mapping node -> number of operands whose class doesn't have a cost yet
+  std::vector<unsigned> numPending(g.numNodeIds(), 0);
+  llvm::SmallVector<ClassId> classWorklist;
+  for (ClassId root : roots) {
+    if (!reachable[root]) {
+      reachable[root] = true;
+      classWorklist.push_back(root);
+    }
+  }
+  while (!classWorklist.empty()) {
+    auto *c = g.getClass(classWorklist.pop_back_val());
+    for (auto &nodes : llvm::make_second_range(c->getNodes())) {
+      for (auto *node : nodes) {
+        numPending[node->getId()] = node->getOperands().size();
+        if (node->getOperands().empty())
+          worklist.push_back(node);
+        for (ClassId o : node->getOperands()) {
+          o = g.getLeaderId(o);
+          parents[o].push_back(node);
+          if (!reachable[o]) {
+            reachable[o] = true;
+            classWorklist.push_back(o);
+          }
         }
       }
-      assert(bestCost >= 0);
-      cost += bestCost;
     }
-    return totalCosts[node] = cost;
-  };
+  }
+
+  bestCosts.assign(g.numClassIds(), Infinity);
+  std::vector<ENode *> bestNodes(g.numClassIds(), nullptr);
+  while (!worklist.empty()) {
+    ENode *node = worklist.front();
+    worklist.pop_front();
+    ClassId cls = g.getLeaderId(node->getClassId());
+    Cost cost = getTreeCost(node, bestCosts);
+    ENode *best = bestNodes[cls];
+    if (best && std::make_pair(cost, node->getId()) >=
+                    std::make_pair(bestCosts[cls], best->getId()))
+      continue;
+    Cost oldCost = bestCosts[cls];
+    bestCosts[cls] = cost;
+    bestNodes[cls] = node;
+    // Same cost with a lower node id: the users' costs don't change
+    if (cost == oldCost)
+      continue;
+    for (auto *user : parents[cls]) {
+      unsigned &pending = numPending[user->getId()];
+      // The class just got its first cost. There is one entry per use, so an
+      // operand used twice is counted down twice.
+      if (!best)
+        pending--;
+      // Users that are still waiting for other operands are costed later
+      if (pending == 0)
+        worklist.push_back(user);
+    }
+  }
+  return bestNodes;
+}
 
-  llvm::SmallVector<EClassBase *> worklist {c};
+// Read off the chosen nodes top-down
+Extractor::Result Extractor::getResult(llvm::ArrayRef<ClassId> roots,
+                                       llvm::ArrayRef<ENode *> bestNodes) {
   Result result;
-  llvm::DenseSet<EClassBase *> visited;
+  llvm::SmallVector<ClassId> worklist(roots.begin(), roots.end());
   while (!worklist.empty()) {
-    auto *c = worklist.pop_back_val();
-    c = c->getLeader();
-    if (!visited.insert(c).second)
+    ClassId cls = worklist.pop_back_val();
+    auto *bestNode = bestNodes[cls];
+    assert(bestNode && "class without a finite term");
+    if (!result.try_emplace(g.getClass(cls), bestNode).second)
       continue;
-    Cost bestCost;
-    ENode *bestNode = nullptr;
-    for (auto &nodes : llvm::make_second_range(c->getNodes())) {
+    for (ClassId o : bestNode->getOperands())
+      worklist.push_back(g.getLeaderId(o));
+  }
+  return result;
+}
+
+Extractor::Result Extractor::extract(EClassBase *c) {
+  return extract(llvm::makeArrayRef(c));
+}
+
+Extractor::Result Extractor::extract(llvm::ArrayRef<EClassBase *> roots) {
+  llvm::SmallVector<ClassId> rootIds;
+  for (auto *c : roots)
+    rootIds.push_back(g.getLeaderId(c->getId()));
+  std::vector<Cost> bestCosts;
+  return getResult(rootIds, findBestNodes(rootIds, bestCosts));
+}
+
+Extractor::Cost Extractor::getDAGCost(const Result &result) {
+  Cost cost = 0;
+  for (auto *node : llvm::make_second_range(result))
+    cost += costOf(node);
+  return cost;
+}
+
+// Depth-first branch and bound over the choice of node for every class that
+// the partial solution needs, in the order in which the classes are first
+// needed. Every class is paid for when its node is chosen, so the cost of a
+// partial solution bounds the cost of its completions. The alternatives of a
+// class are tried by increasing tree cost, so the search first dives towards
+// solutions close to the tree-cost one.
+Extractor::Result Extractor::extractDAG(EClassBase *c, double seconds) {
+  auto start = std::chrono::steady_clock::now();
+  ClassId root = g.getLeaderId(c->getId());
+  std::vector<Cost> treeCosts;
+  auto bestNodes = findBestNodes(root, treeCosts);
+  Result best = getResult(root, bestNodes);
+  Cost bestCost = getDAGCost(best);
+
+  // Alternatives of every class, cheapest tree first. Nodes that use their own
+  // class can't be part of a finite term.
+  std::vector<llvm::SmallVector<std::pair<Cost, ENode *>, 2>> alternatives(
+      g.numClassIds());
+  for (ClassId cls = 0; cls < g.numClassIds(); cls++) {
+    if (!bestNodes[cls])
+      continue;
+    auto &alts = alternatives[cls];
+    for (auto &nodes : llvm::make_second_range(g.getClass(cls)->getNodes())) {
       for (auto *node : nodes) {
-        Cost cost = totalCostOf(node);
-        if (!bestNode || cost < bestCost) {
-          bestNode = node;
+        Cost treeCost = getTreeCost(node, treeCosts);
+        if (treeCost == Infinity ||
+            llvm::any_of(node->getOperands(),
+                         [&](ClassId o) { return g.getLeaderId(o) == cls; }))
+          continue;
+        alts.emplace_back(treeCost, node);
+      }
+    }
+    llvm::sort(alts, [](auto a, auto b) {
+      return std::make_pair(a.first, a.second->getId()) <
+             std::make_pair(b.first, b.second->getId());
+    });
+  }
+
+  std::vector<ENode *> choices(g.numClassIds(), nullptr);
+  // Classes needed by the partial solution; the ones from `head` on haven't
+  // been decided yet (unless they are duplicates)
+  std::vector<ClassId> pending{root};
+  unsigned head = 0;
+  Cost cost = 0;
+  struct Decision {
+    ClassId cls;
+    unsigned nextAlt;
+    // State to go back to before trying the next alternative
+    unsigned head;
+    size_t numPending;
+    Cost cost;
+  };
+  std::vector<Decision> decisions;
+
+  // Return true if the choices reachable from the root form a DAG
+  auto isAcyclic = [&] {
+    // 0 = unvisited, 1 = on the DFS stack, 2 = done
+    std::vector<uint8_t> state(g.numClassIds(), 0);
+    llvm::SmallVector<std::pair<ClassId, unsigned>> stack{{root, 0}};
+    state[root] = 1;
+    while (!stack.empty()) {
+      auto &[cls, i] = stack.back();
+      auto operands = choices[cls]->getOperands();
+      if (i == operands.size()) {
+        state[cls] = 2;
+        stack.pop_back();
+        continue;
+      }
+      ClassId o = g.getLeaderId(operands[i++]);
+      if (state[o] == 1)
+        return false;
+      if (state[o] == 0) {
+        state[o] = 1;
+        stack.emplace_back(o, 0);
+      }
+    }
+    return true;
+  };
+
+  unsigned numSteps = 0;
+  bool backtrack = false;
+  for (;;) {
+    // Check the time budget once in a while
+    if (numSteps++ % 1024 == 0 &&
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                .count() > seconds)
+      break;
+
+    if (!backtrack) {
+      while (head < pending.size() && choices[pending[head]])
+        head++;
+      if (head == pending.size()) {
+        // Complete solution
+        if (cost < bestCost && isAcyclic()) {
           bestCost = cost;
+          best.clear();
+          for (ClassId cls : pending)
+            best.try_emplace(g.getClass(cls), choices[cls]);
         }
+        backtrack = true;
+      } else {
+        decisions.push_back({pending[head], 0, head, pending.size(), cost});
       }
     }
-    assert(bestNode);
-    result[c] = bestNode;
-    worklist.append(bestNode->operand_begin(), bestNode->operand_end());
+
+    if (decisions.empty())
+      break;
+
+    // Undo the last choice of the latest decision and make the next one
+    auto &d = decisions.back();
+    choices[d.cls] = nullptr;
+    pending.resize(d.numPending);
+    head = d.head;
+    cost = d.cost;
+    auto &alts = alternatives[d.cls];
+    while (d.nextAlt < alts.size() &&
+           d.cost + costOf(alts[d.nextAlt].second) >= bestCost)
+      d.nextAlt++;
+    if (d.nextAlt == alts.size()) {
+      decisions.pop_back();
+      backtrack = true;
+      continue;
+    }
+    ENode *node = alts[d.nextAlt++].second;
+    choices[d.cls] = node;
+    cost += costOf(node);
+    head++;
+    for (ClassId o : node->getOperands())
+      pending.push_back(g.getLeaderId(o));
+    backtrack = false;
   }
-  return result;
+  return best;
 }
@@ -1,22 +1,184 @@
 #ifndef EXTRACTOR_H
 #define EXTRACTOR_H
 
+#include "EGraph.h"
 #include "llvm/ADT/DenseMap.h"
+#include <functional>
+#include <limits>
+#include <vector>
 
-class EGraphBase;
-class ENode;
-class EClassBase;
+// Cost of the nodes, looked up by opcode in a table. Opcodes past the end of
+// the table cost `defaultCost`. Opcodes whose cost depends on the node can
+// have a callback instead.
+class CostModel {
+public:
+  using Cost = float;
+  using NodeCostFn = std::function<Cost(const ENode *)>;
+
+  // How the cost of a term is computed from the costs of the subterms
+  enum class Combine {
+    // The node plus the sum of the operands (e.g., AST size)
+    Sum,
+    // The node plus the most expensive operand (e.g., AST depth)
+    Max,
+  };
+
+private:
+  std::vector<Cost> opcodeCosts;
+  std::vector<NodeCostFn> callbacks;
+  Cost defaultCost;
+  Combine combine;
+
+public:
+  CostModel(Cost defaultCost = 1, Combine combine = Combine::Sum)
+      : defaultCost(defaultCost), combine(combine) {}
+  CostModel &setCost(Opcode opcode, Cost cost) {
+    if (opcode >= opcodeCosts.size())
+      opcodeCosts.resize(opcode + 1, defaultCost);
+    opcodeCosts[opcode] = cost;
+    return *this;
+  }
+  CostModel &setCost(Opcode opcode, NodeCostFn fn) {
+    if (opcode >= callbacks.size())
+      callbacks.resize(opcode + 1);
+    callbacks[opcode] = std::move(fn);
+    return *this;
+  }
+
+  Cost costOf(const ENode *node) const {
+    Opcode opcode = node->getOpcode();
+    if (opcode < callbacks.size() && callbacks[opcode])
+      return callbacks[opcode](node);
+    return opcode < opcodeCosts.size() ? opcodeCosts[opcode] : defaultCost;
+  }
+  // Fold the cost of one more operand into `operandsCost`, which starts at 0
+  Cost addOperandCost(Cost operandsCost, Cost operandCost) const {
+    if (combine == Combine::Max)
+      return std::max(operandsCost, operandCost);
+    return operandsCost + operandCost;
+  }
+
+  static CostModel astSize() { return CostModel(1, Combine::Sum); }
+  static CostModel astDepth() { return CostModel(1, Combine::Max); }
+};
 
 class Extractor {
 public:
   using Result = llvm::DenseMap<EClassBase *, ENode *>;
-  using Cost = float;
+  using Cost = CostModel::Cost;
 private:
+  EGraphBase &g;
+  CostModel model;
+
+  // Cost of the term rooted at `node`, given the cost of every class
+  Cost getTreeCost(const ENode *node, llvm::ArrayRef<Cost> classCosts) const;
+
+  // Find the node with the smallest tree cost of every class reachable from
+  // `roots`. `bestCosts` is set to the tree cost of the classes.
+  std::vector<ENode *> findBestNodes(llvm::ArrayRef<ClassId> roots,
+                                     std::vector<Cost> &bestCosts);
+  Result getResult(llvm::ArrayRef<ClassId> roots,
+                   llvm::ArrayRef<ENode *> bestNodes);
+
 public:
-  virtual ~Extractor();
-  // Trivial cost using ast size
-  virtual Cost costOf(ENode *) { return 1; }
+  Extractor(EGraphBase &g, CostModel model = CostModel::astSize())
+      : g(g), model(std::move(model)) {}
+  Cost costOf(const ENode *node) const { return model.costOf(node); }
+  // Minimize the tree cost, i.e., a class is paid for once per use
   Result extract(EClassBase *);
+  // Extract all of `roots` at once, computing the costs of the classes they
+  // share only once. The result covers the classes reachable from any root.
+  Result extract(llvm::ArrayRef<EClassBase *> roots);
+  // Minimize the DAG cost, i.e., the sum of the costs of the nodes with
+  // every class paid for once (whatever the model's Combine is), with a
+  // branch-and-bound search that starts from the tree-cost result. Give up
+  // after `seconds` and return the best result found so far.
+  Result extractDAG(EClassBase *, double seconds = 1);
+  // Sum of the costs of the nodes of `result`
+  Cost getDAGCost(const Result &result);
+};
+
+// E-class analysis keeping the cheapest node (by tree cost) of every class up
+// to date through make(), merge() and rebuild(), so that extraction is a read
+// of the analysis data at any point, e.g., between saturation iterations.
+// Use it in place of NullAnalysis, or next to another analysis with
+// ProductAnalysis:
+//
+//   struct G : public EGraph<G>, CostAnalysis<G> {};
+//
+// The best node of a class may have been replaced by a congruent node since
+// it was chosen, so its operands are not necessarily canonical.
+template <typename EGraphT> class CostAnalysis {
+  CostModel model;
+
+  EGraphT &graph() { return *static_cast<EGraphT *>(this); }
+
+public:
+  using Cost = CostModel::Cost;
+  struct AnalysisData {
+    Cost cost = std::numeric_limits<Cost>::infinity();
+    ENode *node = nullptr;
+    bool operator==(const AnalysisData &other) const {
+      return cost == other.cost && node == other.node;
+    }
+    bool operator!=(const AnalysisData &other) const {
+      return !(*this == other);
+    }
+  };
+
+private:
+  AnalysisData getCostData(ClassId id) {
+    return getAnalysisData<AnalysisData>(graph().getData(id));
+  }
+
+public:
+
+  // Has to be set before adding nodes
+  void setCostModel(CostModel model2) {
+    assert(graph().numNodes() == 0);
+    model = std::move(model2);
+  }
+
+  AnalysisData analyze(ENode *node) {
+    Cost operandsCost = 0;
+    for (ClassId o : node->getOperands())
+      operandsCost = model.addOperandCost(
+          operandsCost, getCostData(graph().getLeaderId(o)).cost);
+    return {model.costOf(node) + operandsCost, node};
+  }
+  // Keep the cheaper node, breaking ties by node id
+  AnalysisData join(AnalysisData a, AnalysisData b) {
+    if (!a.node)
+      return b;
+    if (!b.node)
+      return a;
+    if (std::make_pair(a.cost, a.node->getId()) <=
+        std::make_pair(b.cost, b.node->getId()))
+      return a;
+    return b;
+  }
+  void modify(EClassBase *) {}
+
+  Cost getCost(EClassBase *c) {
+    return getCostData(graph().getLeaderId(c->getId())).cost;
+  }
+  // Read the cheapest term of `c` off the analysis data, in the same shape as
+  // Extractor::extract()
+  Extractor::Result extract(EClassBase *c) {
+    EGraphT &g = graph();
+    Extractor::Result result;
+    llvm::SmallVector<ClassId> worklist{g.getLeaderId(c->getId())};
+    while (!worklist.empty()) {
+      ClassId cls = worklist.pop_back_val();
+      ENode *node = getCostData(cls).node;
+      assert(node);
+      if (!result.try_emplace(g.getClass(cls), node).second)
+        continue;
+      for (ClassId o : node->getOperands())
+        worklist.push_back(g.getLeaderId(o));
+    }
+    return result;
+  }
 };
 
 #endif // EXTRACTOR_H
@@ -0,0 +1,292 @@
+#include "EGraph.h"
+#include "Pattern.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+
+// Relational e-matching (Zhang et al., "Relational E-Matching").
+//
+// Every pattern node is a query variable standing for an e-class, and every
+// non-variable pattern node p = op(p0, ..., pn) is an atom
+// R_op(p, p0, ..., pn) over the relation of all e-nodes with opcode `op`.
+// The conjunctive query is answered with generic join: variables are bound one
+// at a time by intersecting the candidates offered by every atom that mentions
+// the variable, with each atom indexed by a trie in the global variable order.
+
+namespace {
+
+class GenericJoinMatcher {
+  Pattern *root;
+  EGraphBase &g;
+  MatchState &state;
+  MatchVisitor visit;
+
+  // The query variables, one per pattern node
+  llvm::SmallVector<Pattern *> patternNodes;
+  llvm::SmallDenseMap<Pattern *, unsigned, 8> varIds;
+  // Order in which the variables are bound
+  llvm::SmallVector<unsigned> order;
+
+  // Trie nodes, mapping the value of a variable to the child trie. The
+  // children of the last level are not used.
+  std::vector<llvm::DenseMap<ClassId, unsigned>> tries;
+
+  struct Atom {
+    // Column of each distinct variable of the atom, sorted by binding order.
+    // Column 0 is the class of the node and column i + 1 its ith operand.
+    llvm::SmallVector<std::pair<unsigned, unsigned>, 4> vars;
+    // Pairs of columns that are bound to the same variable
+    llvm::SmallVector<std::pair<unsigned, unsigned>, 2> equalities;
+    unsigned trie;
+  };
+  std::vector<Atom> atoms;
+  // Mapping variable -> the atoms in which it appears
+  std::vector<llvm::SmallVector<unsigned, 4>> atomsOf;
+  // Current trie node of every atom during the join
+  std::vector<unsigned> atomPos;
+  // Current binding of every variable
+  std::vector<ClassId> binding;
+
+  void collectPatternNodes();
+  void computeOrder();
+  void buildAtoms();
+  unsigned getOrInsertChild(unsigned trie, ClassId key);
+  void join(unsigned level);
+  void outputSubstitution();
+
+public:
+  GenericJoinMatcher(Pattern *, EGraphBase &g, MatchState &state);
+  // The columns of the matches, one per variable
+  llvm::ArrayRef<Pattern *> getPatterns() const { return patternNodes; }
+  // Return false if the visitor stopped the enumeration
+  bool run(MatchVisitor);
+};
+
+} // namespace
+
+GenericJoinMatcher::GenericJoinMatcher(Pattern *pat, EGraphBase &g,
+                                       MatchState &state)
+    : root(pat), g(g), state(state) {
+  collectPatternNodes();
+  computeOrder();
+  buildAtoms();
+}
+
+void GenericJoinMatcher::collectPatternNodes() {
+  llvm::SmallVector<Pattern *, 8> worklist{root};
+  while (!worklist.empty()) {
+    Pattern *pat = worklist.pop_back_val();
+    if (!varIds.try_emplace(pat, patternNodes.size()).second)
+      continue;
+    patternNodes.push_back(pat);
+    worklist.append(pat->operand_begin(), pat->operand_end());
+  }
+}
+
+void GenericJoinMatcher::computeOrder() {
+  unsigned numVars = patternNodes.size();
+  // Number of atoms each variable appears in
+  std::vector<unsigned> numOccurrences(numVars, 0);
+  // Variables that share an atom
+  std::vector<llvm::SmallVector<unsigned, 4>> neighbors(numVars);
+  for (Pattern *pat : patternNodes) {
+    if (pat->isVar())
+      continue;
+    llvm::SmallVector<unsigned, 4> vars{varIds.lookup(pat)};
+    for (Pattern *operand : pat->getOperands())
+      if (!llvm::is_contained(vars, varIds.lookup(operand)))
+        vars.push_back(varIds.lookup(operand));
+    for (unsigned v : vars) {
+      numOccurrences[v]++;
+      neighbors[v].append(vars.begin(), vars.end());
+    }
+  }
+
+  // Greedily bind the most constrained variable, preferring the ones that are
+  // connected to what's already bound so that every level is an intersection
+  std::vector<bool> chosen(numVars, false), connected(numVars, false);
+  while (order.size() < numVars) {
+    int best = -1;
+    for (unsigned v = 0; v < numVars; v++) {
+      if (chosen[v])
+        continue;
+      if (best < 0 || std::make_pair(connected[v], numOccurrences[v]) >
+                          std::make_pair(connected[best], numOccurrences[best]))
+        best = v;
+    }
+    chosen[best] = true;
+    order.push_back(best);
+    for (unsigned v : neighbors[best])
+      connected[v] = true;
+  }
+}
+
+unsigned GenericJoinMatcher::getOrInsertChild(unsigned trie, ClassId key) {
+  auto it = tries[trie].find(key);
+  if (it != tries[trie].end())
+    return it->second;
+  unsigned child = tries.size();
+  tries.emplace_back();
+  tries[trie][key] = child;
+  return child;
+}
+
+void GenericJoinMatcher::buildAtoms() {
+  unsigned numVars = patternNodes.size();
+  std::vector<unsigned> position(numVars);
+  for (auto item : llvm::enumerate(order))
+    position[item.value()] = item.index();
+
+  // Collect the relation of each opcode once
+  llvm::SmallDenseMap<Opcode, std::vector<ENode *>, 4> relations;
+  for (Pattern *pat : patternNodes) {
+    if (pat->isVar())
+      continue;
+    auto [it, inserted] = relations.try_emplace(pat->getOpcode());
+    if (!inserted)
+      continue;
+    for (auto *c : llvm::make_range(g.class_begin(), g.class_end()))
+      if (auto *nodes = c->getNodesByOpcode(pat->getOpcode()))
+        it->second.insert(it->second.end(), nodes->begin(), nodes->end());
+  }
+
+  atomsOf.resize(numVars);
+  for (Pattern *pat : patternNodes) {
+    if (pat->isVar())
+      continue;
+    auto &atom = atoms.emplace_back();
+    llvm::SmallVector<Pattern *, 4> columns{pat};
+    columns.append(pat->operand_begin(), pat->operand_end());
+    for (unsigned i = 0; i < columns.size(); i++) {
+      auto *first = llvm::find(columns, columns[i]);
+      if (first != columns.begin() + i)
+        atom.equalities.emplace_back(first - columns.begin(), i);
+      else
+        atom.vars.emplace_back(varIds.lookup(columns[i]), i);
+    }
+    llvm::sort(atom.vars, [&](auto a, auto b) {
+      return position[a.first] < position[b.first];
+    });
+    for (auto [var, column] : atom.vars)
+      atomsOf[var].push_back(atoms.size() - 1);
+
+    atom.trie = tries.size();
+    tries.emplace_back();
+    llvm::SmallVector<ClassId, 4> tuple;
+    for (ENode *node : relations[pat->getOpcode()]) {
+      if (node->getOperands().size() != pat->getOperands().size())
+        continue;
+      tuple.clear();
+      tuple.push_back(g.getLeaderId(node->getClassId()));
+      for (ClassId o : node->getOperands())
+        tuple.push_back(g.getLeaderId(o));
+      if (llvm::any_of(atom.equalities, [&](auto eq) {
+            return tuple[eq.first] != tuple[eq.second];
+          }))
+        continue;
+      unsigned trie = atom.trie;
+      for (auto [var, column] : atom.vars)
+        trie = getOrInsertChild(trie, tuple[column]);
+    }
+  }
+
+  atomPos.resize(atoms.size());
+  for (auto item : llvm::enumerate(atoms))
+    atomPos[item.index()] = item.value().trie;
+  binding.assign(numVars, InvalidClassId);
+}
+
+void GenericJoinMatcher::outputSubstitution() {
+  llvm::SmallVector<EClassBase *, 8> row;
+  for (ClassId c : binding)
+    row.push_back(g.getClass(c));
+  state.output(visit, patternNodes, row);
+}
+
+void GenericJoinMatcher::join(unsigned level) {
+  if (state.reachedLimit())
+    return;
+
+  if (level == order.size()) {
+    // Skip the substitutions we've seen before `since`
+    if (llvm::none_of(binding, [&](ClassId c) {
+          return state.isModified(g, g.getClass(c));
+        }))
+      return;
+    if (state.claim())
+      outputSubstitution();
+    return;
+  }
+
+  unsigned var = order[level];
+  auto &candidates = atomsOf[var];
+  // The variable is not constrained by any atom (the pattern is a lone
+  // variable). Try all of the classes.
+  if (candidates.empty()) {
+    for (auto *c : llvm::make_range(g.class_begin(), g.class_end())) {
+      if (state.reachedLimit() || (level == 0 && state.checkDeadline()))
+        break;
+      binding[var] = c->getId();
+      join(level + 1);
+    }
+    return;
+  }
+
+  // Iterate the smallest set of candidates and probe the rest
+  llvm::SmallVector<unsigned, 4> savedPos;
+  for (unsigned a : candidates)
+    savedPos.push_back(atomPos[a]);
+  unsigned smallest = *std::min_element(
+      savedPos.begin(), savedPos.end(),
+      [&](unsigned a, unsigned b) { return tries[a].size() < tries[b].size(); });
+
+  // Only check the deadline between the bindings of the first variable
+  for (auto &kv : tries[smallest]) {
+    if (state.reachedLimit() || (level == 0 && state.checkDeadline()))
+      break;
+    ClassId c = kv.first;
+    bool intersected = true;
+    for (auto item : llvm::enumerate(candidates)) {
+      auto &children = tries[savedPos[item.index()]];
+      auto it = children.find(c);
+      if (it == children.end()) {
+        intersected = false;
+        break;
+      }
+      atomPos[item.value()] = it->second;
+    }
+    if (intersected) {
+      binding[var] = c;
+      join(level + 1);
+    }
+  }
+
+  for (auto item : llvm::enumerate(candidates))
+    atomPos[item.value()] = savedPos[item.index()];
+}
+
+bool GenericJoinMatcher::run(MatchVisitor visitor) {
+  visit = visitor;
+  join(0);
+  return !state.isStopped();
+}
+
+MatchBuffer matchGenericJoin(Pattern *pat, EGraphBase &g, int limit,
+                             unsigned since, MatchDeadline deadline) {
+  MatchState state(limit, since, deadline);
+  GenericJoinMatcher matcher(pat, g, state);
+  // Variable i binds column i
+  auto patterns = matcher.getPatterns();
+  MatchBuffer matches(std::vector<Pattern *>(patterns.begin(), patterns.end()));
+  matcher.run([&](llvm::ArrayRef<Pattern *>, llvm::ArrayRef<EClassBase *> row) {
+    matches.push_back(row);
+    return true;
+  });
+  return matches;
+}
+
+bool matchGenericJoin(Pattern *pat, EGraphBase &g, MatchVisitor visit,
+                      unsigned since) {
+  MatchState state(-1, since);
+  return GenericJoinMatcher(pat, g, state).run(visit);
+}
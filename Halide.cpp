@@ -1,79 +1,82 @@
 #include "Halide.h"
+#include "StaticPattern.h"
 
 // Match
-#define mAdd(a, b) match("+", a, b)
-#define mSub(a, b) match("-", a, b)
-#define mMul(a, b) match("*", a, b)
-#define mDiv(a, b) match("/", a, b)
-#define mMod(a, b) match("%", a, b)
-#define mMax(a, b) match("max", a, b)
-#define mMin(a, b) match("min", a, b)
-#define mLt(a, b) match("<", a, b)
-#define mGt(a, b) match(">", a, b)
-#define mLte(a, b) match("<=", a, b)
-#define mGte(a, b) match(">=", a, b)
-#define mEq(a, b) match("==", a, b)
-#define mNe(a, b) match("!=", a, b)
-#define mOr(a, b) match("||", a, b)
-#define mAnd(a, b) match("&&", a, b)
+#define mAdd(a, b) patternNode<HalideTRS::Add>(a, b)
+#define mSub(a, b) patternNode<HalideTRS::Sub>(a, b)
+#define mMul(a, b) patternNode<HalideTRS::Mul>(a, b)
+#define mDiv(a, b) patternNode<HalideTRS::Div>(a, b)
+#define mMod(a, b) patternNode<HalideTRS::Mod>(a, b)
+#define mMax(a, b) patternNode<HalideTRS::Max>(a, b)
+#define mMin(a, b) patternNode<HalideTRS::Min>(a, b)
+#define mLt(a, b) patternNode<HalideTRS::Lt>(a, b)
+#define mGt(a, b) patternNode<HalideTRS::Gt>(a, b)
+#define mLte(a, b) patternNode<HalideTRS::Lte>(a, b)
+#define mGte(a, b) patternNode<HalideTRS::Gte>(a, b)
+#define mEq(a, b) patternNode<HalideTRS::Eq>(a, b)
+#define mNe(a, b) patternNode<HalideTRS::Ne>(a, b)
+#define mOr(a, b) patternNode<HalideTRS::Or>(a, b)
+#define mAnd(a, b) patternNode<HalideTRS::And>(a, b)
 
 // Write
-#define wAdd(a, b) make("+", a, b)
-#define wSub(a, b) make("-", a, b)
-#define wMul(a, b) make("*", a, b)
-#define wDiv(a, b) make("/", a, b)
-#define wMod(a, b) make("%", a, b)
-#define wMax(a, b) make("max", a, b)
-#define wMin(a, b) make("min", a, b)
-#define wLt(a, b) make("<", a, b)
-#define wGt(a, b) make(">", a, b)
-#define wLte(a, b) make("<=", a, b)
-#define wGte(a, b) make(">=", a, b)
-#define wEq(a, b) make("==", a, b)
-#define wNe(a, b) make("!=", a, b)
-#define wOr(a, b) make("||", a, b)
-#define wAnd(a, b) make("&&", a, b)
-
-#define a var("a")
-#define b var("b")
-#define c var("c")
-
-#define x var("x")
-#define y var("y")
-#define z var("z")
+#define wAdd(a, b) make(HalideTRS::Add, a, b)
+#define wSub(a, b) make(HalideTRS::Sub, a, b)
+#define wMul(a, b) make(HalideTRS::Mul, a, b)
+#define wDiv(a, b) make(HalideTRS::Div, a, b)
+#define wMod(a, b) make(HalideTRS::Mod, a, b)
+#define wMax(a, b) make(HalideTRS::Max, a, b)
+#define wMin(a, b) make(HalideTRS::Min, a, b)
+#define wLt(a, b) make(HalideTRS::Lt, a, b)
+#define wGt(a, b) make(HalideTRS::Gt, a, b)
+#define wLte(a, b) make(HalideTRS::Lte, a, b)
+#define wGte(a, b) make(HalideTRS::Gte, a, b)
+#define wEq(a, b) make(HalideTRS::Eq, a, b)
+#define wNe(a, b) make(HalideTRS::Ne, a, b)
+#define wOr(a, b) make(HalideTRS::Or, a, b)
+#define wAnd(a, b) make(HalideTRS::And, a, b)
+
+#define mConst(x) patternConst(x)
+
+#define a PatternVar<'a'>()
+#define b PatternVar<'b'>()
+#define c PatternVar<'c'>()
+
+#define x PatternVar<'x'>()
+#define y PatternVar<'y'>()
+#define z PatternVar<'z'>()
 
 // Add
-REWRITE(HalideTRS, AddAssoc, mAdd(mAdd(a, b), c), wAdd(a, wAdd(b, c)))
-REWRITE(HalideTRS, AddComm, mAdd(a, b), wAdd(b, a))
-REWRITE(HalideTRS, AddZero, mAdd(a, mConst(0)), a)
-REWRITE(HalideTRS, AddDistMul, mMul(a, mAdd(b, c)), wAdd(wMul(a, b), wMul(a, c)))
-REWRITE(HalideTRS, AddFactMul, mAdd(mMul(a, b), mMul(a, c)), wMul(a, wAdd(b, c)))
-REWRITE(HalideTRS, AddDenomMul, mAdd(mDiv(a, b), c), wDiv(wAdd(a, wMul(b, c)), b))
-REWRITE(HalideTRS, AddDenomDiv, mDiv(mAdd(a, mMul(b, c)), b), wAdd(wDiv(a, b), c))
-REWRITE(HalideTRS, AddDivMod, mAdd(mDiv(x, mConst(2)), mMod(x, mConst(2))),
+STATIC_REWRITE(HalideTRS, AddAssoc, mAdd(mAdd(a, b), c), wAdd(a, wAdd(b, c)))
+STATIC_REWRITE(HalideTRS, AddComm, mAdd(a, b), wAdd(b, a))
+STATIC_REWRITE(HalideTRS, AddZero, mAdd(a, mConst(0)), a)
+STATIC_REWRITE(HalideTRS, AddDistMul, mMul(a, mAdd(b, c)), wAdd(wMul(a, b), wMul(a, c)))
+STATIC_REWRITE(HalideTRS, AddFactMul, mAdd(mMul(a, b), mMul(a, c)), wMul(a, wAdd(b, c)))
+STATIC_REWRITE(HalideTRS, AddDenomMul, mAdd(mDiv(a, b), c), wDiv(wAdd(a, wMul(b, c)), b))
+STATIC_REWRITE(HalideTRS, AddDenomDiv, mDiv(mAdd(a, mMul(b, c)), b), wAdd(wDiv(a, b), c))
+STATIC_REWRITE(HalideTRS, AddDivMod, mAdd(mDiv(x, mConst(2)), mMod(x, mConst(2))),
                               wDiv(wAdd(x, constant(1)), constant(2)))
 
 // Sub
-REWRITE(HalideTRS, SubToAdd, mSub(a, b), wAdd(a, wMul(constant(-1), b)))
+STATIC_REWRITE(HalideTRS, SubToAdd, mSub(a, b), wAdd(a, wMul(constant(-1), b)))
 
 // Mul
-REWRITE(HalideTRS, MulAssoc, mMul(mMul(a, b), c), wMul(a, wMul(b, c)))
-REWRITE(HalideTRS, MulComm, mMul(a, b), wMul(b, a))
-REWRITE(HalideTRS, MulZero, mMul(a, mConst(0)), constant(0))
-REWRITE(HalideTRS, MulOne, mMul(a, mConst(1)), a)
-REWRITE(HalideTRS, MulCancelDiv, mMul(mDiv(a, b), b), wSub(a, wMod(a, b)))
-REWRITE(HalideTRS, MulMaxMin, mMul(mMax(a, b), mMin(a, b)), wMul(a, b))
-REWRITE(HalideTRS, DivCancelMul, mDiv(mMul(y, x), x), y)
+STATIC_REWRITE(HalideTRS, MulAssoc, mMul(mMul(a, b), c), wMul(a, wMul(b, c)))
+STATIC_REWRITE(HalideTRS, MulComm, mMul(a, b), wMul(b, a))
+STATIC_REWRITE(HalideTRS, MulZero, mMul(a, mConst(0)), constant(0))
+STATIC_REWRITE(HalideTRS, MulOne, mMul(a, mConst(1)), a)
+STATIC_REWRITE(HalideTRS, MulCancelDiv, mMul(mDiv(a, b), b), wSub(a, wMod(a, b)))
+STATIC_REWRITE(HalideTRS, MulMaxMin, mMul(mMax(a, b), mMin(a, b)), wMul(a, b))
+STATIC_REWRITE(HalideTRS, DivCancelMul, mDiv(mMul(y, x), x), y)
 
 
 // Eq
-REWRITE(HalideTRS, EqComm, mEq(a, b), wEq(b, a))
-REWRITE(HalideTRS, EqSub0, mEq(x, y), wEq(wSub(x, y), constant(0)))
-REWRITE(HalideTRS, EqSwap, mEq(mAdd(x, y), z), wEq(x, wSub(z, y)))
-REWRITE(HalideTRS, EqRefl, mEq(x, x), constant(1))
-REWRITE(HalideTRS, EqMul0, mEq(mMul(x, y), mConst(0)), wOr(wEq(x, constant(0)), wEq(y, constant(0))))
-REWRITE(HalideTRS, EqMaxLt, mEq(mMax(x, y), y), wLte(x, y))
-REWRITE(HalideTRS, EqMinLt, mEq(mMin(x, y), y), wLte(y, x))
+STATIC_REWRITE(HalideTRS, EqComm, mEq(a, b), wEq(b, a))
+STATIC_REWRITE(HalideTRS, EqSub0, mEq(x, y), wEq(wSub(x, y), constant(0)))
+STATIC_REWRITE(HalideTRS, EqSwap, mEq(mAdd(x, y), z), wEq(x, wSub(z, y)))
+STATIC_REWRITE(HalideTRS, EqRefl, mEq(x, x), constant(1))
+STATIC_REWRITE(HalideTRS, EqMul0, mEq(mMul(x, y), mConst(0)), wOr(wEq(x, constant(0)), wEq(y, constant(0))))
+STATIC_REWRITE(HalideTRS, EqMaxLt, mEq(mMax(x, y), y), wLte(x, y))
+STATIC_REWRITE(HalideTRS, EqMinLt, mEq(mMin(x, y), y), wLte(y, x))
 
 std::vector<std::unique_ptr<Rewrite<HalideTRS>>> getRewrites(HalideTRS &h) {
   std::vector<std::unique_ptr<Rewrite<HalideTRS>>> rewrites;
@@ -102,3 +105,81 @@ std::vector<std::unique_ptr<Rewrite<HalideTRS>>> getRewrites(HalideTRS &h) {
   rewrites.emplace_back(new EqMinLt(h));
   return rewrites;
 }
+
+CostModel getHalideCostModel() {
+  CostModel model(0);
+  for (Opcode op = 0; op < HalideTRS::NumOps; op++)
+    model.setCost(op, 1);
+  model.setCost(HalideTRS::Mul, 3);
+  model.setCost(HalideTRS::Div, 20);
+  model.setCost(HalideTRS::Mod, 20);
+  return model;
+}
+
+#undef a
+#undef b
+#undef c
+#undef x
+#undef y
+#undef z
+#undef mConst
+
+namespace {
+class ExprParser {
+  HalideTRS &h;
+  llvm::StringRef rest;
+
+  llvm::StringRef nextToken() {
+    rest = rest.ltrim();
+    if (rest.empty())
+      return rest;
+    size_t len = 1;
+    if (rest.front() != '(' && rest.front() != ')')
+      len = rest.find_first_of(" \t\r\n()");
+    llvm::StringRef tok = rest.take_front(len);
+    rest = rest.drop_front(tok.size());
+    return tok;
+  }
+
+public:
+  ExprParser(HalideTRS &h, llvm::StringRef expr) : h(h), rest(expr) {}
+
+  EClassBase *parse() {
+    llvm::StringRef tok = nextToken();
+    if (tok.empty() || tok == ")")
+      return nullptr;
+    if (tok != "(") {
+      int x;
+      if (!tok.getAsInteger(10, x))
+        return h.constant(x);
+      return h.var(tok.str());
+    }
+
+    std::string opcode = nextToken().str();
+    if (!h.opcodeMap.count(opcode))
+      return nullptr;
+    llvm::SmallVector<EClassBase *, 2> operands;
+    while (!rest.ltrim().startswith(")")) {
+      auto *operand = parse();
+      if (!operand)
+        return nullptr;
+      operands.push_back(operand);
+    }
+    nextToken();
+    // All of the operators are binary
+    if (operands.size() != 2)
+      return nullptr;
+    return h.make(opcode, operands);
+  }
+
+  bool done() { return rest.trim().empty(); }
+};
+} // namespace
+
+EClassBase *parseHalideExpr(HalideTRS &h, llvm::StringRef expr) {
+  ExprParser parser(h, expr);
+  auto *c = parser.parse();
+  if (!c || !parser.done())
+    return nullptr;
+  return c;
+}
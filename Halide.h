@@ -1,55 +1,30 @@
 #ifndef HALIDE_H
 #define HALIDE_H
 
+#include "Extractor.h"
 #include "Language.h"
 #include <optional>
 
-// Halide TRS
-class HalideTRS : public Language<int, HalideTRS> {
+// Constant folding for HalideTRS: the data of a class is its value, if it's
+// known to be a constant, and a class with a value is merged with the
+// constant.
+template <typename EGraphT> class HalideConstantFolding {
+  EGraphT &graph() { return *static_cast<EGraphT *>(this); }
+
 public:
   using AnalysisData = std::optional<int>;
-  HalideTRS()
-      : Language<int, HalideTRS>({
-            "+",
-            "-",
-            "*",
-            "/",
-            "%",
-            "max",
-            "min",
-            "<",
-            ">",
-            "<=",
-            ">=",
-            "==",
-            "!=",
-            "||",
-            "&&",
-        }) {}
-
-  EClassBase *add(EClassBase *a, EClassBase *b) { return make("+", {a, b}); }
-  EClassBase *sub(EClassBase *a, EClassBase *b) { return make("-", {a, b}); }
-  EClassBase *mul(EClassBase *a, EClassBase *b) { return make("*", {a, b}); }
-  EClassBase *div(EClassBase *a, EClassBase *b) { return make("/", {a, b}); }
-  EClassBase *mod(EClassBase *a, EClassBase *b) { return make("%", {a, b}); }
-  EClassBase *max(EClassBase *a, EClassBase *b) { return make("max", {a, b}); }
-  EClassBase *min(EClassBase *a, EClassBase *b) { return make("min", {a, b}); }
-  EClassBase *lt(EClassBase *a, EClassBase *b) { return make("<", {a, b}); }
-  EClassBase *gt(EClassBase *a, EClassBase *b) { return make(">", {a, b}); }
-  EClassBase *lte(EClassBase *a, EClassBase *b) { return make("<=", {a, b}); }
-  EClassBase *gte(EClassBase *a, EClassBase *b) { return make(">=", {a, b}); }
-  EClassBase *eq(EClassBase *a, EClassBase *b) { return make("==", {a, b}); }
-  EClassBase *ne(EClassBase *a, EClassBase *b) { return make("!=", {a, b}); }
-  EClassBase *and_(EClassBase *a, EClassBase *b) { return make("&&", {a, b}); }
-  EClassBase *or_(EClassBase *a, EClassBase *b) { return make("||", {a, b}); }
-
-  // e-class analysis
+
+  AnalysisData getConstant(ClassId id) {
+    return getAnalysisData<AnalysisData>(graph().getData(id));
+  }
+  AnalysisData getConstant(EClassBase *c) { return getConstant(c->getId()); }
+
   AnalysisData analyze(ENode *node) {
     auto opcode = node->getOpcode();
     int x;
-    if (is_constant(opcode, x)) {
+    if (graph().is_constant(opcode, x)) {
 #ifndef NDEBUG
-      if (auto y = getData(node->getClass()))
+      if (auto y = getConstant(node->getClassId()))
         assert(x == *y);
 #endif
       return x;
@@ -59,42 +34,49 @@ public:
     if (operands.size() != 2)
       return std::nullopt;
 
-    auto a = getData(operands[0]);
-    auto b = getData(operands[1]);
+    auto a = getConstant(operands[0]);
+    auto b = getConstant(operands[1]);
     if (!a || !b)
       return std::nullopt;
 
-    if (opcode == getOpcode("+"))
+    switch (opcode) {
+    case EGraphT::Add:
       return *a + *b;
-    if (opcode == getOpcode("-"))
+    case EGraphT::Sub:
       return *a - *b;
-    if (opcode == getOpcode("*"))
+    case EGraphT::Mul:
       return *a * *b;
-    if (opcode == getOpcode("/") && *b != 0)
+    case EGraphT::Div:
+      if (*b == 0)
+        return std::nullopt;
       return *a / *b;
-    if (opcode == getOpcode("%") && *b != 0)
+    case EGraphT::Mod:
+      if (*b == 0)
+        return std::nullopt;
       return *a % *b;
-    if (opcode == getOpcode("max"))
+    case EGraphT::Max:
       return *a > *b ? *a : *b;
-    if (opcode == getOpcode("min"))
-      return *a > *b ? *a : *b;
-    if (opcode == getOpcode("<"))
+    case EGraphT::Min:
+      return *a < *b ? *a : *b;
+    case EGraphT::Lt:
       return *a < *b;
-    if (opcode == getOpcode(">"))
+    case EGraphT::Gt:
       return *a > *b;
-    if (opcode == getOpcode("<="))
+    case EGraphT::Lte:
       return *a <= *b;
-    if (opcode == getOpcode(">="))
+    case EGraphT::Gte:
       return *a >= *b;
-    if (opcode == getOpcode("=="))
+    case EGraphT::Eq:
       return *a == *b;
-    if (opcode == getOpcode("!="))
+    case EGraphT::Ne:
       return *a != *b;
-    if (opcode == getOpcode("&&"))
+    case EGraphT::And:
       return *a && *b;
-    if (opcode == getOpcode("||"))
+    case EGraphT::Or:
       return *a || *b;
-    return std::nullopt;
+    default:
+      return std::nullopt;
+    }
   }
 
   AnalysisData join(AnalysisData a, AnalysisData b) { 
@@ -103,9 +85,67 @@ public:
   }
 
   void modify(EClassBase *c) {
-    if (auto x = getData(c))
-      merge(c, constant(*x));
+    if (auto x = getConstant(c))
+      graph().merge(c, graph().constant(*x));
   }
+};
+
+// Approximate latency of the operators on a CPU. Variables and constants are
+// free.
+CostModel getHalideCostModel();
+
+// Halide TRS. Besides folding constants, it keeps the cheapest term of every
+// class under getHalideCostModel() (see CostAnalysis).
+class HalideTRS
+    : public Language<int, HalideTRS>,
+      public ProductAnalysis<HalideTRS, HalideConstantFolding<HalideTRS>,
+                             CostAnalysis<HalideTRS>> {
+public:
+  // Opcodes of the operators, in the order of `OpNames`
+  enum Op : Opcode {
+    Add,
+    Sub,
+    Mul,
+    Div,
+    Mod,
+    Max,
+    Min,
+    Lt,
+    Gt,
+    Lte,
+    Gte,
+    Eq,
+    Ne,
+    Or,
+    And,
+    NumOps,
+  };
+  static constexpr const char *OpNames[NumOps] = {
+      "+", "-", "*", "/", "%", "max", "min", "<", ">", "<=", ">=", "==", "!=",
+      "||", "&&",
+  };
+
+  HalideTRS()
+      : Language<int, HalideTRS>(
+            std::vector<std::string>(std::begin(OpNames), std::end(OpNames))) {
+    setCostModel(getHalideCostModel());
+  }
+
+  EClassBase *add(EClassBase *a, EClassBase *b) { return make(Add, {a, b}); }
+  EClassBase *sub(EClassBase *a, EClassBase *b) { return make(Sub, {a, b}); }
+  EClassBase *mul(EClassBase *a, EClassBase *b) { return make(Mul, {a, b}); }
+  EClassBase *div(EClassBase *a, EClassBase *b) { return make(Div, {a, b}); }
+  EClassBase *mod(EClassBase *a, EClassBase *b) { return make(Mod, {a, b}); }
+  EClassBase *max(EClassBase *a, EClassBase *b) { return make(Max, {a, b}); }
+  EClassBase *min(EClassBase *a, EClassBase *b) { return make(Min, {a, b}); }
+  EClassBase *lt(EClassBase *a, EClassBase *b) { return make(Lt, {a, b}); }
+  EClassBase *gt(EClassBase *a, EClassBase *b) { return make(Gt, {a, b}); }
+  EClassBase *lte(EClassBase *a, EClassBase *b) { return make(Lte, {a, b}); }
+  EClassBase *gte(EClassBase *a, EClassBase *b) { return make(Gte, {a, b}); }
+  EClassBase *eq(EClassBase *a, EClassBase *b) { return make(Eq, {a, b}); }
+  EClassBase *ne(EClassBase *a, EClassBase *b) { return make(Ne, {a, b}); }
+  EClassBase *and_(EClassBase *a, EClassBase *b) { return make(And, {a, b}); }
+  EClassBase *or_(EClassBase *a, EClassBase *b) { return make(Or, {a, b}); }
 
   void printIndent(int indent) {
     for (int i = 0; i < indent; i++)
@@ -120,9 +160,9 @@ public:
       errs() << varName << '\n';
     } else if (opcodeName != "") {
       errs() << "(" << opcodeName;
-      for (auto *o : node->getOperands()) {
+      for (ClassId o : node->getOperands()) {
         errs() << ' ' << o;
-        if (auto x = getData(o))
+        if (auto x = getConstant(o))
           errs() << "[data=" << *x << ']';
       }
       errs() << ")\n";
@@ -147,7 +187,7 @@ public:
       dump(c);
       errs() << "}\n";
       errs() << "\t data = ";
-      if (auto x = getData(c)) {
+      if (auto x = getConstant(c)) {
         errs() << *x << '\n';
       } else {
         errs() << "null\n";
@@ -158,7 +198,7 @@ public:
   void classRep(EClassBase *c) override {
     c = getLeader(c);
     errs() << c << "[data=";
-    if (auto x = getData(c)) {
+    if (auto x = getConstant(c)) {
       errs() << *x << ']';
     } else {
       errs() << "null]";
@@ -168,4 +208,8 @@ public:
 
 std::vector<std::unique_ptr<Rewrite<HalideTRS>>> getRewrites(HalideTRS &h);
 
+// Parse an expression written in prefix notation, e.g., (+ v0 (* v1 2)), into
+// `h`. Return null if the expression is malformed.
+EClassBase *parseHalideExpr(HalideTRS &h, llvm::StringRef expr);
+
 #endif // HALIDE_H
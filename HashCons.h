@@ -0,0 +1,181 @@
+#ifndef HASH_CONS_H
+#define HASH_CONS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace hashcons_detail {
+
+// Control byte of a slot: empty, or the low 7 bits of the hash of the node
+// stored in it.
+enum Ctrl : int8_t { Empty = -128 };
+
+#if defined(__SSE2__)
+// Group of control bytes probed with a single 16-byte compare
+struct Group {
+  static constexpr unsigned Width = 16;
+  __m128i ctrl;
+
+  explicit Group(const int8_t *pos)
+      : ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(pos))) {}
+
+  uint32_t match(int8_t h2) const {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl));
+  }
+
+  uint32_t matchEmpty() const { return match(Empty); }
+};
+#else
+struct Group {
+  static constexpr unsigned Width = 8;
+  const int8_t *ctrl;
+
+  explicit Group(const int8_t *pos) : ctrl(pos) {}
+
+  template <typename Pred> uint32_t matchIf(Pred pred) const {
+    uint32_t mask = 0;
+    for (unsigned i = 0; i < Width; i++)
+      mask |= uint32_t(pred(ctrl[i])) << i;
+    return mask;
+  }
+
+  uint32_t match(int8_t h2) const {
+    return matchIf([h2](int8_t c) { return c == h2; });
+  }
+
+  uint32_t matchEmpty() const { return match(Empty); }
+};
+#endif
+
+} // namespace hashcons_detail
+
+// Open-addressing (Swiss table) set of nodes, keyed by (opcode, operands).
+//
+// Slots are probed a group at a time by comparing 7 bits of the hash stored in
+// the control bytes, so only slots whose hash fragment matches are ever
+// dereferenced. Lookups take a borrowed opcode/operand view, and every node
+// caches its own hash (NodeT::getHash()), so neither probing nor growing the
+// table rehashes operands.
+template <typename NodeT> class HashCons {
+  using Group = hashcons_detail::Group;
+  static constexpr unsigned MinCapacity = Group::Width;
+
+  // Capacity + Group::Width control bytes. The first Group::Width bytes are
+  // mirrored after the end so that a group can be loaded at any slot.
+  std::vector<int8_t> ctrl;
+  std::vector<NodeT *> slots;
+  size_t mask = 0;
+  size_t numItems = 0;
+  // Number of empty slots we can still fill before we have to rehash
+  size_t growthLeft = 0;
+
+  static size_t h1(unsigned hash) { return hash >> 7; }
+  static int8_t h2(unsigned hash) { return hash & 0x7f; }
+
+  size_t capacity() const { return slots.size(); }
+
+  static size_t maxItems(size_t capacity) { return capacity - capacity / 8; }
+
+  void setCtrl(size_t i, int8_t c) {
+    ctrl[i] = c;
+    if (i < Group::Width)
+      ctrl[capacity() + i] = c;
+  }
+
+  // Visit the groups that may contain `hash` in probing order until `fn`
+  // returns true.
+  template <typename Fn> void probe(unsigned hash, Fn fn) const {
+    size_t pos = h1(hash) & mask;
+    // Triangular probing visits every group when the capacity is a power of 2
+    for (size_t step = Group::Width;; step += Group::Width) {
+      if (fn(pos, Group(&ctrl[pos])))
+        return;
+      pos = (pos + step) & mask;
+    }
+  }
+
+  size_t findInsertSlot(unsigned hash) const {
+    size_t slot = 0;
+    probe(hash, [&](size_t pos, Group g) {
+      if (uint32_t m = g.matchEmpty()) {
+        slot = (pos + llvm::countTrailingZeros(m)) & mask;
+        return true;
+      }
+      return false;
+    });
+    return slot;
+  }
+
+  void rehash(size_t newCapacity) {
+    assert(llvm::isPowerOf2_64(newCapacity) && newCapacity >= MinCapacity);
+    auto oldSlots = std::move(slots);
+    auto oldCtrl = std::move(ctrl);
+    slots.assign(newCapacity, nullptr);
+    ctrl.assign(newCapacity + Group::Width, hashcons_detail::Empty);
+    mask = newCapacity - 1;
+    growthLeft = maxItems(newCapacity) - numItems;
+    for (size_t i = 0, n = oldSlots.size(); i < n; i++) {
+      if (oldCtrl[i] == hashcons_detail::Empty)
+        continue;
+      NodeT *node = oldSlots[i];
+      size_t slot = findInsertSlot(node->getHash());
+      setCtrl(slot, h2(node->getHash()));
+      slots[slot] = node;
+    }
+  }
+
+public:
+  size_t size() const { return numItems; }
+
+  static unsigned hash(unsigned opcode, llvm::ArrayRef<uint32_t> operands) {
+    // FxHash; the high half of the product is the best mixed
+    const uint64_t seed = 0x517cc1b727220a95ULL;
+    uint64_t h = (uint64_t(opcode) + 1) * seed;
+    for (uint32_t o : operands)
+      h = (((h << 5) | (h >> 59)) ^ o) * seed;
+    return h >> 32;
+  }
+
+  NodeT *find(unsigned opcode, llvm::ArrayRef<uint32_t> operands,
+              unsigned hash) const {
+    if (numItems == 0)
+      return nullptr;
+    NodeT *result = nullptr;
+    probe(hash, [&](size_t pos, Group g) {
+      for (uint32_t m = g.match(h2(hash)); m; m &= m - 1) {
+        NodeT *node = slots[(pos + llvm::countTrailingZeros(m)) & mask];
+        if (node->getHash() == hash && node->getOpcode() == opcode &&
+            node->getOperands() == operands) {
+          result = node;
+          return true;
+        }
+      }
+      return g.matchEmpty() != 0;
+    });
+    return result;
+  }
+
+  // Insert a node that's not in the table
+  void insert(NodeT *node) {
+    unsigned hash = node->getHash();
+    assert(!find(node->getOpcode(), node->getOperands(), hash));
+    if (growthLeft == 0)
+      rehash(std::max<size_t>(capacity() * 2, MinCapacity));
+    size_t slot = findInsertSlot(hash);
+    growthLeft--;
+    setCtrl(slot, h2(hash));
+    slots[slot] = node;
+    numItems++;
+  }
+};
+
+#endif // HASH_CONS_H
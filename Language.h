@@ -61,10 +61,17 @@ public:
     return varMap.lookup(var);
   }
 
+  // Opcodes are numbered in the order they are passed to the constructor, so
+  // a language can also refer to them with a compile-time enum and skip the
+  // string lookup.
   EClassBase *make(std::string opcode, llvm::ArrayRef<EClassBase *> operands) {
     assert(opcodeMap.count(opcode));
     return Base::make(opcodeMap.lookup(opcode), operands);
   }
+  EClassBase *make(Opcode opcode, llvm::ArrayRef<EClassBase *> operands) {
+    assert(invOpcodeMap.count(opcode));
+    return Base::make(opcode, operands);
+  }
 
   EClassBase *var(std::string var) {
     auto [it, inserted] = varMap.try_emplace(var);
@@ -89,6 +96,9 @@ public:
   }
 };
 
+// A rewrite written in terms of a language: the left-hand side is matched
+// with match(), the right-hand side is built with make(), and the two share
+// the variables created by var()
 template <typename LanguageT>
 class LanguageRewrite : public Rewrite<LanguageT> {
   LanguageT &l;
@@ -107,6 +117,10 @@ protected:
     return Rewrite<LanguageT>::match(l.getOpcode(opcode),
                                      std::forward<ArgTypes>(args)...);
   }
+  template <typename... ArgTypes>
+  Pattern *match(Opcode opcode, ArgTypes... args) {
+    return Rewrite<LanguageT>::match(opcode, std::forward<ArgTypes>(args)...);
+  }
 
   // match a constant
   template <typename T>
@@ -114,28 +128,31 @@ protected:
     return Rewrite<LanguageT>::match(l.getConstOpcode(x));
   }
 
+  // The right-hand side is a pattern too, the variables are resolved once
+  // when it's compiled instead of by name for every match
   template <typename... ArgTypes>
-  EClassBase *make(std::string opcode, ArgTypes... args) {
-    return l.make(opcode, {std::forward<ArgTypes>(args)...});
+  Pattern *make(std::string opcode, ArgTypes... args) {
+    return match(opcode, std::forward<ArgTypes>(args)...);
+  }
+  template <typename... ArgTypes>
+  Pattern *make(Opcode opcode, ArgTypes... args) {
+    return match(opcode, std::forward<ArgTypes>(args)...);
   }
 
   template <typename T>
-  EClassBase *constant(T x) { return l.constant(x); }
+  Pattern *constant(T x) { return mConst(x); }
 
 public:
   LanguageRewrite(LanguageT &l) : l(l) {}
-  using LookupFuncTy = std::function<EClassBase *(llvm::StringRef)>;
-  virtual EClassBase *rhs(LookupFuncTy var) = 0;
-  EClassBase *apply(const PatternToClassMap &m, LanguageT &l) override {
-    return rhs(
-        [&](llvm::StringRef name) { return m.lookup(varMap.lookup(name)); });
-  }
 };
 
 #define REWRITE(LANG, RW, LHS, RHS)                                            \
   struct RW : public LanguageRewrite<LANG> {                                   \
-    RW(LANG &l) : LanguageRewrite<LANG>(l) { root = LHS; name = #RW; }                     \
-    EClassBase *rhs(LookupFuncTy var) override { return RHS; }                 \
+    RW(LANG &l) : LanguageRewrite<LANG>(l) {                                   \
+      root = LHS;                                                              \
+      rhs = RHS;                                                               \
+      name = #RW;                                                              \
+    }                                                                          \
   };
 
 #endif // LANGUAGE_H
@@ -1,9 +1,9 @@
 #include "Pattern.h"
 #include "EGraph.h"
-#include "llvm/ADT/PointerUnion.h"
 #include "llvm/ADT/STLExtras.h"
-#include "llvm/ADT/ScopedHashTable.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Parallel.h"
 #include "llvm/Support/raw_ostream.h"
 
 using llvm::errs;
@@ -15,196 +15,432 @@ Pattern::Pattern(Opcode opcode,
     item.value()->addUse(this, item.index());
 }
 
-namespace {
-class PatternMatcher {
-  Pattern *root;
-  EGraphBase &g;
-  std::vector<Substitution> &matches;
-  int limit;
-  llvm::SmallVector<Pattern *> patternNodes;
-  using ClassOrNode = llvm::PointerUnion<EClassBase *, ENode *>;
-  llvm::ScopedHashTable<Pattern *, ClassOrNode> subst;
-  using Scope = decltype(subst)::ScopeTy;
-  bool runImpl(unsigned level);
-  bool runOnVar(Pattern *var, unsigned level);
-  bool runOnPattern(Pattern *var, unsigned level);
-  auto classes() const { return llvm::make_range(g.class_begin(), g.class_end()); }
-  void outputSubstitution();
+MatchProgram::MatchProgram(Pattern *root) {
+  // Order the pattern nodes in DFS order; the ith node is bound by the ith
+  // instruction into register i
+  llvm::SmallDenseMap<Pattern *, unsigned, 8> regs;
+  llvm::SmallVector<Pattern *, 8> worklist{root};
+  while (!worklist.empty()) {
+    Pattern *pat = worklist.pop_back_val();
+    if (!regs.try_emplace(pat, insts.size()).second)
+      continue;
+    auto &inst = insts.emplace_back();
+    inst.pat = pat;
+    columns.push_back(pat);
+    worklist.append(pat->operand_begin(), pat->operand_end());
+  }
 
-public:
-  PatternMatcher(Pattern *, EGraphBase &g, std::vector<Substitution> &matches, int limit);
-  void run();
-};
-} // namespace
+  // Figure out which neighbors are already bound when we reach an instruction
+  for (auto item : llvm::enumerate(insts)) {
+    auto &inst = item.value();
+    unsigned reg = item.index();
+    for (auto [userPat, operandId] : inst.pat->getUses()) {
+      auto it = regs.find(userPat);
+      if (it != regs.end() && it->second < reg)
+        inst.users.emplace_back(it->second, operandId);
+    }
+    if (inst.pat->isVar())
+      continue;
+    for (auto operand : llvm::enumerate(inst.pat->getOperands())) {
+      unsigned operandReg = regs.lookup(operand.value());
+      if (operandReg < reg)
+        inst.operands.emplace_back(operandReg, operand.index());
+    }
+  }
+}
 
-PatternMatcher::PatternMatcher(Pattern *pat, EGraphBase &g,
-                               std::vector<Substitution> &matches, int limit)
-    : root(pat), g(g), matches(matches), limit(limit) {
+RHSProgram::RHSProgram(Pattern *rhs) {
+  // Give the variables the first slots
+  llvm::SmallDenseMap<Pattern *, unsigned, 8> slots;
+  llvm::SmallVector<Pattern *, 8> worklist{rhs};
   llvm::SmallPtrSet<Pattern *, 8> visited;
-  llvm::SmallVector<Pattern *, 8> worklist{pat};
   while (!worklist.empty()) {
     Pattern *pat = worklist.pop_back_val();
     if (!visited.insert(pat).second)
       continue;
-    patternNodes.push_back(pat);
+    if (pat->isVar()) {
+      slots[pat] = vars.size();
+      vars.push_back(pat);
+    }
     worklist.append(pat->operand_begin(), pat->operand_end());
   }
+
+  // Then the nodes in post-order, a node shared by several users is made once
+  llvm::SmallVector<std::pair<Pattern *, bool>, 8> stack{{rhs, false}};
+  while (!stack.empty()) {
+    auto [pat, expanded] = stack.pop_back_val();
+    if (slots.count(pat))
+      continue;
+    if (!expanded) {
+      stack.emplace_back(pat, true);
+      for (Pattern *operand : pat->getOperands())
+        stack.emplace_back(operand, false);
+      continue;
+    }
+    auto &inst = insts.emplace_back();
+    inst.opcode = pat->getOpcode();
+    for (Pattern *operand : pat->getOperands())
+      inst.operands.push_back(slots.lookup(operand));
+    slots[pat] = vars.size() + insts.size() - 1;
+  }
 }
 
-void PatternMatcher::outputSubstitution() {
-  auto &match = matches.emplace_back();
-  for (auto *pat : patternNodes) {
-    if (pat->isVar())
-      match.emplace_back(pat, subst.lookup(pat).get<EClassBase *>());
-    else
-      match.emplace_back(pat, subst.lookup(pat).get<ENode *>()->getClass());
+llvm::SmallVector<unsigned, 4>
+RHSProgram::getColumns(const MatchBuffer &matches) const {
+  llvm::SmallVector<unsigned, 4> columns;
+  for (Pattern *var : vars) {
+    int column = matches.getColumn(var);
+    assert(column >= 0 && "variable not bound by the left-hand side");
+    columns.push_back(column);
   }
-  assert(subst.lookup(root).get<ENode *>()->getClass());
-  //match.emplace_back(root, subst.lookup(root).get<ENode *>()->getClass());
+  return columns;
 }
 
-bool PatternMatcher::runImpl(unsigned level) {
-  if (limit > 0 && matches.size() >= limit)
-    return false;
+namespace {
+class ProgramExecutor {
+  using class_range = llvm::iterator_range<EGraphBase::class_iterator>;
 
-  if (level == patternNodes.size()) {
-    outputSubstitution();
-    return true;
+  llvm::ArrayRef<MatchProgram::Instruction> insts;
+  llvm::ArrayRef<Pattern *> columns;
+  EGraphBase &g;
+  MatchVisitor visit;
+  // Shared by all of the executors running the program
+  MatchState &state;
+  // Candidates for the first instruction
+  class_range rootClasses;
+
+  // The class bound by each instruction, and the node if it's not a variable
+  struct Register {
+    EClassBase *cls;
+    ENode *node;
+  };
+  llvm::SmallVector<Register, 8> regs;
+  // The classes of the registers, passed to the visitor
+  llvm::SmallVector<EClassBase *, 8> row;
+
+  bool runImpl(unsigned pc);
+  bool runOnVar(const MatchProgram::Instruction &inst, unsigned pc);
+  bool runOnPattern(const MatchProgram::Instruction &inst, unsigned pc);
+  bool bindNode(ENode *node, unsigned pc);
+  class_range classes(unsigned pc) const {
+    if (pc == 0)
+      return rootClasses;
+    return llvm::make_range(g.class_begin(), g.class_end());
   }
+  bool reachedLimit() const { return state.reachedLimit(); }
+  void outputSubstitution();
+
+public:
+  ProgramExecutor(const MatchProgram &prog, EGraphBase &g, MatchVisitor visit,
+                  MatchState &state, class_range rootClasses)
+      : insts(prog.getInstructions()), columns(prog.getPatterns()), g(g),
+        visit(visit), state(state), rootClasses(rootClasses),
+        regs(insts.size()) {}
+  // Return false if the visitor stopped the enumeration
+  bool run() {
+    runImpl(0);
+    return !state.isStopped();
+  }
+};
+} // namespace
 
-  Scope scope(subst);
-  Pattern *pat = patternNodes[level];
-  if (pat->isVar())
-    return runOnVar(pat, level);
-  return runOnPattern(pat, level);
+void ProgramExecutor::outputSubstitution() {
+  row.clear();
+  for (auto &reg : regs)
+    row.push_back(reg.cls);
+  assert(regs.front().node->getClassId() != InvalidClassId);
+  state.output(visit, columns, row);
 }
 
-bool PatternMatcher::runOnVar(Pattern *var, unsigned level) {
-  assert(var->isVar());
-  llvm::SmallPtrSet<EClassBase *, 1> candidates;
-  // Find candidates based on bound parents (users)
-  for (auto [userPat, operandId] : var->getUses()) {
-    auto *user = subst.lookup(userPat).dyn_cast<ENode *>();
-    if (!user)
-      continue;
-    // `var` has to bind to a node in class `c`
-    auto *c = user->getOperands()[operandId];
-    candidates.insert(c);
-    if (candidates.size() > 1)
-      break;
+bool ProgramExecutor::runImpl(unsigned pc) {
+  if (reachedLimit())
+    return false;
+
+  if (pc == insts.size()) {
+    // Skip the substitutions we've seen before `since`
+    if (llvm::none_of(regs, [&](const Register &reg) {
+          return state.isModified(g, reg.cls);
+        }))
+      return false;
+    if (!state.claim())
+      return false;
+    outputSubstitution();
+    return true;
   }
 
-  // Impossible: backtrack
-  if (candidates.size() > 1)
-    return false;
+  auto &inst = insts[pc];
+  if (inst.pat->isVar())
+    return runOnVar(inst, pc);
+  return runOnPattern(inst, pc);
+}
 
-  if (candidates.size() == 1) {
-    assert(subst.lookup(var).isNull());
-    subst.insert(var, *candidates.begin());
+bool ProgramExecutor::runOnVar(const MatchProgram::Instruction &inst,
+                               unsigned pc) {
+  // Find the candidate based on bound parents (users)
+  if (!inst.users.empty()) {
+    auto [userReg, operandId] = inst.users.front();
+    auto *c = g.getLeader(regs[userReg].node->getOperands()[operandId]);
+    for (auto [userReg, operandId] : llvm::drop_begin(inst.users)) {
+      // Impossible: backtrack
+      if (!g.isEquivalent(regs[userReg].node->getOperands()[operandId],
+                          c->getId()))
+        return false;
+    }
+    regs[pc] = {c, nullptr};
     // Recursively match the rest of the pattern nodes
-    return runImpl(level + 1);
+    return runImpl(pc + 1);
   }
 
-  assert(candidates.empty());
   // No constraints on which class we have to bind. Try all of them!
   bool matched = false;
-  for (auto *c : classes()) {
-    subst.insert(var, c);
-    matched |= runImpl(level + 1);
+  for (auto *c : classes(pc)) {
+    if (reachedLimit())
+      break;
+    regs[pc] = {c, nullptr};
+    matched |= runImpl(pc + 1);
   }
   return matched;
 }
 
-static std::vector<ENode *> intersect(std::vector<llvm::DenseSet<ENode *> *> srcs) {
-  // Sort the sets by size
-  llvm::sort(srcs, [](auto *set1, auto *set2) { return set1->size() < set2->size(); });
-  auto *set0 = srcs.front();
-  std::vector<ENode *> intersection;
-  for (auto *n : *set0) {
-    bool intersected = true;
-    for (auto *s : llvm::drop_begin(srcs)) {
-      if (!s->count(n)) {
-        intersected = false;
-        break;
-      }
-    }
-    if (intersected)
-      intersection.push_back(n);
-  }
-  return intersection;
+bool ProgramExecutor::bindNode(ENode *node, unsigned pc) {
+  regs[pc] = {g.getClass(node->getClassId()), node};
+  return runImpl(pc + 1);
 }
 
-bool PatternMatcher::runOnPattern(Pattern *pat, unsigned level) {
-  assert(!pat->isVar());
-  std::vector<llvm::DenseSet<ENode *> *> candidates;
+bool ProgramExecutor::runOnPattern(const MatchProgram::Instruction &inst,
+                                   unsigned pc) {
+  Opcode opcode = inst.pat->getOpcode();
+  llvm::SmallVector<llvm::DenseSet<ENode *> *, 4> candidates;
   // Find candidates based on bound parents (users)
-  for (auto [userPat, operandId] : pat->getUses()) {
-    auto *user = subst.lookup(userPat).dyn_cast<ENode *>();
-    if (!user)
-      continue;
-    // `pat` has to bind to a node in class `c`
-    auto *c = user->getOperands()[operandId];
-    c = c->getLeader();
-    //assert(c->isLeader());
-    auto *nodes = c->getNodesByOpcode(pat->getOpcode());
+  for (auto [userReg, operandId] : inst.users) {
+    // The node has to be in class `c`
+    auto *c = g.getLeader(regs[userReg].node->getOperands()[operandId]);
+    auto *nodes = c->getNodesByOpcode(opcode);
     // Backtrack if stuck
     if (!nodes || nodes->empty())
       return false;
     candidates.push_back(nodes);
   }
   // Find candidates based on bound operands
-  for (auto item : llvm::enumerate(pat->getOperands())) {
-    Pattern *operandPat = item.value();
-    unsigned operandId = item.index();
-    auto boundValue = subst.lookup(operandPat);
-    if (boundValue.isNull())
-      continue;
-    EClassBase *operandClass = nullptr;
-    if (operandPat->isVar())
-      operandClass = boundValue.get<EClassBase *>();
-    else
-      operandClass = boundValue.get<ENode *>()->getClass();
-    assert(operandClass);
-    auto *nodes = g.getLeader(operandClass)->getUsersByUses(pat->getOpcode(), operandId);
+  for (auto [operandReg, operandId] : inst.operands) {
+    EClassBase *operandClass = regs[operandReg].cls;
+    auto *nodes =
+        g.getLeader(operandClass)->getUsersByUses(opcode, operandId);
     // Backtrack if stuck
     if (!nodes || nodes->empty())
       return false;
     assert(all_of(*nodes, [&](auto *node) {
           return operandId < node->getOperands().size() &&
-          g.isEquivalent(node->getOperands()[operandId], operandClass);
+          g.isEquivalent(node->getOperands()[operandId], operandClass->getId());
           }));
     candidates.push_back(nodes);
   }
 
+  bool matched = false;
   if (!candidates.empty()) {
-    bool matched = false;
-    for (auto *node : intersect(std::move(candidates))) {
-      subst.insert(pat, node);
-      matched |= runImpl(level+1);
-    }
+    // Intersect the candidates on the fly: walk the smallest set and look the
+    // nodes up in the others
+    std::swap(candidates.front(),
+              *std::min_element(candidates.begin(), candidates.end(),
+                                [](auto *set1, auto *set2) {
+                                  return set1->size() < set2->size();
+                                }));
+    for (auto *node : *candidates.front())
+      if (llvm::all_of(llvm::drop_begin(candidates),
+                       [&](auto *set) { return set->count(node); }))
+        matched |= bindNode(node, pc);
     return matched;
   }
-  
+
   // Try everything
-  bool matched = false;
-  for (auto *c : classes()) {
+  for (auto *c : classes(pc)) {
+    if (reachedLimit())
+      break;
     assert(g.getLeader(c) == c);
-    auto *nodes = c->getNodesByOpcode(pat->getOpcode());
+    auto *nodes = c->getNodesByOpcode(opcode);
     if (!nodes)
       continue;
-    for (auto *node : *nodes) {
-      subst.insert(pat, node);
-      matched |= runImpl(level+1);
-    }
+    for (auto *node : *nodes)
+      matched |= bindNode(node, pc);
   }
   return matched;
 }
 
-void PatternMatcher::run() { runImpl(0); }
+MatchBuffer matchInChunks(EGraphBase &g, std::vector<Pattern *> columns,
+                          MatchState &state, ChunkMatcher matchChunk) {
+  // Number of candidate classes of the root matched by one task
+  constexpr unsigned ChunkSize = 256;
+  ClassId numIds = g.numClassIds();
+  unsigned numChunks = (numIds + ChunkSize - 1) / ChunkSize;
+
+  std::vector<MatchBuffer> chunkMatches(numChunks, MatchBuffer(columns));
+  auto runChunk = [&](size_t i) {
+    if (state.reachedLimit() || state.checkDeadline())
+      return;
+    ClassId begin = i * ChunkSize;
+    ClassId end = std::min<ClassId>(begin + ChunkSize, numIds);
+    auto collect = [&](llvm::ArrayRef<Pattern *>,
+                       llvm::ArrayRef<EClassBase *> row) {
+      chunkMatches[i].push_back(row);
+      return true;
+    };
+    matchChunk(g.classRange(begin, end), collect);
+  };
+  // The matchers only read the e-graph, so the chunks can be matched in
+  // parallel by LLVM's shared executor (a nested parallel region, e.g. with
+  // saturate() matching several rewrites at once, runs sequentially).
+  // Computing the number of threads queries the OS, so only do it once.
+  static const unsigned numThreads =
+      llvm::parallel::strategy.compute_thread_count();
+  if (chunkMatches.size() > 1 && numThreads > 1)
+    llvm::parallelForEachN(0, chunkMatches.size(), runChunk);
+  else
+    for (size_t i = 0; i < chunkMatches.size(); i++)
+      runChunk(i);
 
-std::vector<Substitution> match(Pattern *pat, EGraphBase &g, int limit) {
-  std::vector<Substitution> matches;
-  PatternMatcher matcher(pat, g, matches, limit);
-  matcher.run();
+  MatchBuffer matches(std::move(columns));
+  size_t total = 0;
+  for (auto &ms : chunkMatches)
+    total += ms.size();
+  matches.reserve(total);
+  for (auto &ms : chunkMatches)
+    matches.append(ms);
   return matches;
 }
+
+MatchBuffer MatchProgram::run(EGraphBase &g, int limit, unsigned since,
+                              MatchDeadline deadline) const {
+  MatchState state(limit, since, deadline);
+  auto matchChunk =
+      [&](llvm::iterator_range<EGraphBase::class_iterator> rootClasses,
+          MatchVisitor collect) {
+        ProgramExecutor(*this, g, collect, state, rootClasses).run();
+      };
+  return matchInChunks(g, columns, state, matchChunk);
+}
+
+bool MatchProgram::run(EGraphBase &g, MatchVisitor visit,
+                       unsigned since) const {
+  MatchState state(-1, since);
+  ProgramExecutor executor(*this, g, visit, state,
+                           llvm::make_range(g.class_begin(), g.class_end()));
+  return executor.run();
+}
+
+MatchBuffer match(Pattern *pat, EGraphBase &g, int limit, MatchEngine engine,
+                  unsigned since) {
+  if (engine == MatchEngine::GenericJoin)
+    return matchGenericJoin(pat, g, limit, since);
+  return MatchProgram(pat).run(g, limit, since);
+}
+
+bool match(Pattern *pat, EGraphBase &g, MatchVisitor visit, MatchEngine engine,
+           unsigned since) {
+  if (engine == MatchEngine::GenericJoin)
+    return matchGenericJoin(pat, g, visit, since);
+  return MatchProgram(pat).run(g, visit, since);
+}
+
+Scheduler::~Scheduler() {}
+
+void BackoffScheduler::reset(unsigned numRewrites) {
+  stats.assign(numRewrites, Stat());
+}
+
+bool BackoffScheduler::shouldMatch(unsigned rw, unsigned iter) {
+  return iter >= stats[rw].bannedUntil;
+}
+
+int BackoffScheduler::getMatchLimit(unsigned rw, unsigned iter) {
+  // One more than the threshold, so that we can tell it's been exceeded
+  return getThreshold(rw) + 1;
+}
+
+bool BackoffScheduler::shouldApply(unsigned rw, unsigned iter,
+                                   const MatchBuffer &matches) {
+  // Count the substitutions, like egg does
+  if (matches.size() <= getThreshold(rw))
+    return true;
+  auto &stat = stats[rw];
+  stat.bannedUntil = iter + (banLength << stat.numBans);
+  stat.numBans++;
+  return false;
+}
+
+bool BackoffScheduler::canStop(unsigned iter) {
+  bool banned = false;
+  for (auto &stat : stats) {
+    // A rule banned in `iter` hasn't looked for the matches it dropped
+    if (stat.bannedUntil > iter) {
+      banned = true;
+      stat.bannedUntil = iter + 1;
+    }
+  }
+  return !banned;
+}
+
+const char *getStopReasonName(StopReason reason) {
+  switch (reason) {
+  case StopReason::Saturated:
+    return "saturated";
+  case StopReason::IterationLimit:
+    return "iteration limit";
+  case StopReason::NodeLimit:
+    return "node limit";
+  case StopReason::ClassLimit:
+    return "class limit";
+  case StopReason::TimeLimit:
+    return "time limit";
+  case StopReason::MemoryLimit:
+    return "memory limit";
+  case StopReason::GoalReached:
+    return "goal reached";
+  }
+  llvm_unreachable("unknown stop reason");
+}
+
+std::optional<StopReason> RunLimits::check(const EGraphBase &g,
+                                           double elapsed) const {
+  if (nodes && g.numNodes() > nodes)
+    return StopReason::NodeLimit;
+  if (classes && g.numClasses() > classes)
+    return StopReason::ClassLimit;
+  if (seconds && elapsed > seconds)
+    return StopReason::TimeLimit;
+  if (memory && llvm::sys::Process::GetMallocUsage() > memory)
+    return StopReason::MemoryLimit;
+  return std::nullopt;
+}
+
+void RunStats::writeJSON(llvm::raw_ostream &os) const {
+  llvm::json::OStream json(os, 2);
+  json.array([&] {
+    for (auto item : llvm::enumerate(iterations)) {
+      auto &iter = item.value();
+      json.object([&] {
+        json.attribute("iteration", int64_t(item.index()));
+        json.attribute("match_seconds", iter.matchSeconds);
+        json.attribute("apply_seconds", iter.applySeconds);
+        json.attribute("rebuild_seconds", iter.rebuildSeconds);
+        json.attribute("nodes_added", iter.nodesAdded);
+        json.attribute("classes_added", iter.classesAdded);
+        json.attribute("merges", iter.numMerges);
+        json.attribute("nodes", iter.numNodes);
+        json.attribute("classes", iter.numClasses);
+        json.attributeArray("rules", [&] {
+          for (auto rule : llvm::enumerate(iter.rules)) {
+            // Skip the rewrites the scheduler didn't run
+            if (!rule.value().matched)
+              continue;
+            json.object([&] {
+              json.attribute("name", ruleNames[rule.index()]);
+              json.attribute("matches", rule.value().numMatches);
+              json.attribute("banned", rule.value().banned);
+            });
+          }
+        });
+      });
+    }
+  });
+  os << '\n';
+}
@@ -2,8 +2,15 @@
 #define PATTERN_H
 
 #include "EGraph.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <vector>
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Support/raw_ostream.h"
 
 extern int dontPrint;
@@ -47,19 +54,248 @@ public:
   }
 };
 
-using Substitution = llvm::SmallVector<std::pair<Pattern *, EClassBase *>, 4>;
+// The substitutions found for a pattern, as a table with a column per pattern
+// node and a row per match. The patterns are stored once, and the classes of
+// all of the rows in one array.
+class MatchBuffer {
+  std::vector<Pattern *> columns;
+  std::vector<EClassBase *> bindings;
 
-std::vector<Substitution> match(Pattern *, EGraphBase &, int limit=-1);
+public:
+  MatchBuffer() = default;
+  explicit MatchBuffer(std::vector<Pattern *> columns)
+      : columns(std::move(columns)) {}
+
+  llvm::ArrayRef<Pattern *> getPatterns() const { return columns; }
+  unsigned numColumns() const { return columns.size(); }
+  // Number of matches
+  size_t size() const {
+    return columns.empty() ? 0 : bindings.size() / columns.size();
+  }
+  bool empty() const { return bindings.empty(); }
+  // Number of classes bound by all of the matches
+  size_t numBindings() const { return bindings.size(); }
+
+  // The classes bound by the `i`th match, in column order
+  llvm::ArrayRef<EClassBase *> operator[](size_t i) const {
+    return llvm::makeArrayRef(bindings).slice(i * columns.size(),
+                                              columns.size());
+  }
+  // Return the column of `pat`, or -1. There are only a few columns, and the
+  // root usually comes first.
+  int getColumn(Pattern *pat) const {
+    for (unsigned i = 0; i < columns.size(); i++)
+      if (columns[i] == pat)
+        return i;
+    return -1;
+  }
+  EClassBase *lookup(size_t i, Pattern *pat) const {
+    int column = getColumn(pat);
+    return column < 0 ? nullptr : (*this)[i][column];
+  }
+
+  // Add a match and return its bindings to fill in
+  llvm::MutableArrayRef<EClassBase *> addRow() {
+    bindings.resize(bindings.size() + columns.size());
+    return llvm::MutableArrayRef<EClassBase *>(bindings).take_back(
+        columns.size());
+  }
+  void push_back(llvm::ArrayRef<EClassBase *> row) {
+    assert(row.size() == columns.size());
+    bindings.insert(bindings.end(), row.begin(), row.end());
+  }
+  // Add the matches of a buffer with the same columns
+  void append(const MatchBuffer &other) {
+    assert(other.columns == columns);
+    bindings.insert(bindings.end(), other.bindings.begin(),
+                    other.bindings.end());
+  }
+  void reserve(size_t numMatches) {
+    bindings.reserve(numMatches * columns.size());
+  }
+  void clear() { bindings.clear(); }
+};
+
+// Called with the columns and the classes of every match of a streaming
+// match, as soon as it's found. Returning false stops the enumeration. The
+// e-graph must not change until the match is over.
+using MatchVisitor = llvm::function_ref<bool(llvm::ArrayRef<Pattern *>,
+                                             llvm::ArrayRef<EClassBase *>)>;
+
+// When to give up looking for matches
+using MatchDeadline = std::chrono::steady_clock::time_point;
+
+// The bookkeeping shared by the matchers enumerating the substitutions of one
+// pattern, which may run on several threads: at most `limit` matches are
+// produced, only the ones binding a class modified in epoch `since` or later,
+// and everything stops once the visitor says so or the deadline has passed.
+class MatchState {
+  int limit;
+  unsigned since;
+  MatchDeadline deadline;
+  // Number of matches claimed by all of the matchers
+  std::atomic<unsigned> numMatches{0};
+  // The visitor asked us to stop, or we ran out of time
+  std::atomic<bool> stopped{false};
+
+public:
+  explicit MatchState(int limit = -1, unsigned since = 0,
+                      MatchDeadline deadline = MatchDeadline::max())
+      : limit(limit), since(since), deadline(deadline) {}
+
+  // Return if the matchers should stop looking for matches
+  bool reachedLimit() const {
+    return stopped || (limit > 0 && numMatches >= unsigned(limit));
+  }
+  // Return if a substitution binding `c` is new. All of them are if we're not
+  // matching incrementally.
+  bool isModified(const EGraphBase &g, EClassBase *c) const {
+    return !since || g.isModifiedSince(c, since);
+  }
+  // Claim a slot for a match, other matchers may have raced us to the limit
+  bool claim() { return limit <= 0 || numMatches++ < unsigned(limit); }
+  // Pass a match to `visit`, stopping all of the matchers if it returns false
+  void output(MatchVisitor visit, llvm::ArrayRef<Pattern *> columns,
+              llvm::ArrayRef<EClassBase *> row) {
+    if (!visit(columns, row))
+      stopped = true;
+  }
+  bool isStopped() const { return stopped; }
+  // Stop all of the matchers if the deadline has passed. Reading the clock
+  // isn't free, so this is only checked every once in a while, e.g., per chunk
+  // of root classes.
+  bool checkDeadline() {
+    if (deadline != MatchDeadline::max() &&
+        std::chrono::steady_clock::now() >= deadline)
+      stopped = true;
+    return stopped;
+  }
+};
+
+// Match the candidates of the root in chunks of consecutive class ids, by
+// calling `matchChunk` with the classes of every chunk and a visitor that
+// collects the matches. The chunks are matched in parallel, and the matches
+// concatenated in the order of the classes so that the result is the same as
+// for a sequential run (unless a match limit or the deadline is hit). The
+// chunks left once `state` says to stop are skipped.
+using ChunkMatcher = llvm::function_ref<void(
+    llvm::iterator_range<EGraphBase::class_iterator>, MatchVisitor)>;
+MatchBuffer matchInChunks(EGraphBase &, std::vector<Pattern *> columns,
+                          MatchState &state, ChunkMatcher matchChunk);
+
+// A pattern compiled for backtracking matching. The pattern nodes are bound
+// one per instruction, in DFS order, into a register file indexed by
+// instruction; each instruction records which of its users and operands are
+// bound by earlier instructions and so constrain its candidates.
+class MatchProgram {
+public:
+  struct Instruction {
+    Pattern *pat;
+    // <register, operand id> of the users bound so far
+    llvm::SmallVector<std::pair<unsigned, unsigned>, 2> users;
+    // <register, operand id> of the operands bound so far
+    llvm::SmallVector<std::pair<unsigned, unsigned>, 2> operands;
+  };
+
+private:
+  std::vector<Instruction> insts;
+  // The pattern of every instruction, i.e., the columns of the matches
+  std::vector<Pattern *> columns;
+
+public:
+  explicit MatchProgram(Pattern *root);
+  llvm::ArrayRef<Instruction> getInstructions() const { return insts; }
+  llvm::ArrayRef<Pattern *> getPatterns() const { return columns; }
+  // The candidates of the root are split into chunks that are matched in
+  // parallel (see matchInChunks). At most `limit` matches are returned across
+  // all of the chunks, and only the ones found before `deadline`.
+  MatchBuffer run(EGraphBase &, int limit = -1, unsigned since = 0,
+                  MatchDeadline deadline = MatchDeadline::max()) const;
+  // Pass the matches to `visit` one by one, in order, on this thread. Return
+  // false if the visitor stopped the enumeration.
+  bool run(EGraphBase &, MatchVisitor visit, unsigned since = 0) const;
+};
+
+// The right-hand side of a rewrite compiled for instantiation. The variables
+// take the first slots and every instruction makes one node, in post-order,
+// into the next slot, so instantiating a match is a straight walk over the
+// instructions.
+class RHSProgram {
+public:
+  struct Instruction {
+    Opcode opcode;
+    // Slots of the operands
+    llvm::SmallVector<unsigned, 2> operands;
+  };
+
+private:
+  std::vector<Pattern *> vars;
+  std::vector<Instruction> insts;
+
+public:
+  explicit RHSProgram(Pattern *rhs);
+  llvm::ArrayRef<Instruction> getInstructions() const { return insts; }
+  // Return the column of `matches` that binds every variable
+  llvm::SmallVector<unsigned, 4> getColumns(const MatchBuffer &matches) const;
+
+  // Instantiate `row`, whose variables are bound by `columns`. The slots are
+  // scratch space shared across calls.
+  template <typename EGraphT>
+  EClassBase *instantiate(llvm::ArrayRef<EClassBase *> row,
+                          llvm::ArrayRef<unsigned> columns, EGraphT &g,
+                          llvm::SmallVectorImpl<EClassBase *> &slots) const {
+    slots.clear();
+    for (unsigned column : columns)
+      slots.push_back(row[column]);
+    llvm::SmallVector<EClassBase *, 4> operands;
+    for (auto &inst : insts) {
+      operands.clear();
+      for (unsigned slot : inst.operands)
+        operands.push_back(slots[slot]);
+      // Skip the language's checks, constants don't have registered opcodes
+      slots.push_back(g.EGraph<EGraphT>::make(inst.opcode, operands));
+    }
+    return slots.back();
+  }
+};
+
+// Algorithms for finding the substitutions of a pattern
+enum class MatchEngine {
+  // Bind the pattern nodes one by one in DFS order, backtracking on conflict
+  Backtracking,
+  // Relational e-matching with generic join
+  GenericJoin,
+};
+
+// Only the substitutions that bind at least one class modified in epoch
+// `since` or later are returned (and count towards `limit`).
+MatchBuffer match(Pattern *, EGraphBase &, int limit = -1,
+                  MatchEngine engine = MatchEngine::Backtracking,
+                  unsigned since = 0);
+MatchBuffer matchGenericJoin(Pattern *, EGraphBase &, int limit = -1,
+                             unsigned since = 0,
+                             MatchDeadline deadline = MatchDeadline::max());
+// Streaming versions, which never materialize the matches. Return false if
+// the visitor stopped the enumeration.
+bool match(Pattern *, EGraphBase &, MatchVisitor visit,
+           MatchEngine engine = MatchEngine::Backtracking, unsigned since = 0);
+bool matchGenericJoin(Pattern *, EGraphBase &, MatchVisitor visit,
+                      unsigned since = 0);
 
 using PatternToClassMap = llvm::SmallDenseMap<Pattern *, EClassBase *, 4>;
 
 template<typename EGraphT>
 class Rewrite {
   std::vector<Pattern *> patternNodes;
+  // `root` compiled for the backtracking matcher, built on first use
+  std::unique_ptr<MatchProgram> program;
+  // `rhs` compiled for instantiation, built on first use
+  std::unique_ptr<RHSProgram> rhsProgram;
 
 protected:
   std::string name;
   Pattern *root;
+  MatchEngine engine = MatchEngine::Backtracking;
   template <typename... ArgTypes> Pattern *match(Opcode op, ArgTypes... args) {
     patternNodes.push_back(
         Pattern::make(op, {std::forward<ArgTypes>(args)...}));
@@ -70,71 +306,420 @@ protected:
     return patternNodes.back();
   }
 
+  // The right-hand side, if it can be written as a pattern over the variables
+  // of the left-hand side. Otherwise apply() builds it.
+  Pattern *rhs = nullptr;
+
   // Apply the rewrite given a matched pattern
-  virtual EClassBase *apply(const PatternToClassMap &, EGraphT &) = 0;
+  virtual EClassBase *apply(const PatternToClassMap &, EGraphT &) {
+    llvm_unreachable("rewrite without a right-hand side");
+  }
 
 public:
   virtual ~Rewrite() {}
   // The left-hand side
   Pattern *sourcePattern() const { return root; }
-  void applyMatches(llvm::ArrayRef<Substitution> matches, EGraphT &g) {
-    for (auto &m : matches) {
-      PatternToClassMap subst(m.begin(), m.end());
-      auto *c = apply(subst, g);
-      g.merge(c, subst.lookup(root));
+  // The right-hand side, if it's a pattern
+  Pattern *targetPattern() const { return rhs; }
+  // Matching stops at `deadline`, and returns what it found so far
+  virtual MatchBuffer
+  findMatches(EGraphBase &g, int limit = -1, unsigned since = 0,
+              MatchDeadline deadline = MatchDeadline::max()) {
+    if (engine == MatchEngine::GenericJoin)
+      return matchGenericJoin(root, g, limit, since, deadline);
+    if (!program)
+      program = std::make_unique<MatchProgram>(root);
+    return program->run(g, limit, since, deadline);
+  }
+  // Pass the matches of the left-hand side to `visit` as they are found
+  virtual bool forEachMatch(EGraphBase &g, MatchVisitor visit,
+                            unsigned since = 0) {
+    if (engine == MatchEngine::GenericJoin)
+      return matchGenericJoin(root, g, visit, since);
+    if (!program)
+      program = std::make_unique<MatchProgram>(root);
+    return program->run(g, visit, since);
+  }
+  // Apply the matches from `begin` to `end` (or the last one)
+  void applyMatches(const MatchBuffer &matches, EGraphT &g, size_t begin = 0,
+                    size_t end = ~size_t(0)) {
+    end = std::min(end, matches.size());
+    if (begin >= end)
+      return;
+    if (rhs && !rhsProgram)
+      rhsProgram = std::make_unique<RHSProgram>(rhs);
+    int rootColumn = matches.getColumn(root);
+    assert(rootColumn >= 0 && "the root isn't bound");
+    llvm::SmallVector<unsigned, 4> varColumns;
+    if (rhsProgram)
+      varColumns = rhsProgram->getColumns(matches);
+    llvm::SmallVector<EClassBase *, 8> slots;
+    for (size_t i = begin; i < end; i++) {
+      auto row = matches[i];
+      EClassBase *c;
+      if (rhsProgram) {
+        c = rhsProgram->instantiate(row, varColumns, g, slots);
+      } else {
+        PatternToClassMap subst;
+        for (auto [pat, cls] : llvm::zip(matches.getPatterns(), row))
+          subst[pat] = cls;
+        c = apply(subst, g);
+      }
+      g.merge(c, row[rootColumn]);
     }
   }
   std::string getName() const { return name; }
+  MatchEngine getMatchEngine() const { return engine; }
+  void setMatchEngine(MatchEngine engine2) { engine = engine2; }
 };
 
-template<typename EGraphT>
-void saturate(llvm::ArrayRef<std::unique_ptr<Rewrite<EGraphT>>> rewrites, EGraphT &g, int iters = 10000) {
-  unsigned size;
+// Decides, per rewrite and per iteration of saturate(), whether to look for
+// matches, how many, and whether to apply what was found. Rewrites are
+// identified by their index in the list given to saturate().
+class Scheduler {
+public:
+  virtual ~Scheduler();
+  // Called once before saturation starts
+  virtual void reset(unsigned numRewrites) {}
+  // Return if rewrite `rw` should be matched in iteration `iter`
+  virtual bool shouldMatch(unsigned rw, unsigned iter) { return true; }
+  // Maximum number of matches to look for, unlimited if <= 0
+  virtual int getMatchLimit(unsigned rw, unsigned iter) { return -1; }
+  // Return if the matches found for `rw` should be applied. Rejected matches
+  // are dropped and will be looked for again later.
+  virtual bool shouldApply(unsigned rw, unsigned iter,
+                           const MatchBuffer &matches) {
+    return true;
+  }
+  // Return if saturation can stop after iteration `iter`, which didn't
+  // change the e-graph
+  virtual bool canStop(unsigned iter) { return true; }
+};
+
+// Match and apply every rewrite in every iteration
+class SimpleScheduler : public Scheduler {};
+
+// Exponential backoff (as in egg): a rewrite that produces more than its
+// threshold of matches is banned for a number of iterations, and both its
+// threshold and the length of its next ban double. Matching is incremental,
+// so a rewrite coming back from a ban finds everything it missed at once;
+// the defaults are smaller than egg's (1000 and 5) so that the AC rewrites
+// are held back early instead of being banned for most of the run.
+class BackoffScheduler : public Scheduler {
+  unsigned matchLimit;
+  unsigned banLength;
+
   struct Stat {
-    int numBans;
-    int bannedUntil;
-    Stat() : numBans(0), bannedUntil(-1) {}
+    unsigned numBans = 0;
+    unsigned bannedUntil = 0;
   };
+  std::vector<Stat> stats;
 
-  const unsigned banLen = 5;
-  const unsigned matchLimit = 1000;
-
-  llvm::DenseMap<Rewrite<EGraphT> *, Stat> stats;
-  for (auto &rw : rewrites)
-    stats.try_emplace(rw.get());
-
-  for (int i = 0; i < iters; i++) {
-    size = g.numNodes();
-    std::vector<std::vector<Substitution>> matches;
-    for (auto &rw : rewrites) {
-      // Skip banned rewrite
-      auto &stat = stats[rw.get()];
-      if (stat.bannedUntil > 0 && stat.bannedUntil < i) {
-        matches.emplace_back();
+  unsigned getThreshold(unsigned rw) const {
+    return matchLimit << stats[rw].numBans;
+  }
+
+public:
+  BackoffScheduler(unsigned matchLimit = 100, unsigned banLength = 2)
+      : matchLimit(matchLimit), banLength(banLength) {}
+  void reset(unsigned numRewrites) override;
+  bool shouldMatch(unsigned rw, unsigned iter) override;
+  int getMatchLimit(unsigned rw, unsigned iter) override;
+  bool shouldApply(unsigned rw, unsigned iter,
+                   const MatchBuffer &matches) override;
+  // Lift the bans (so we only stop once nothing applies) if there are any
+  bool canStop(unsigned iter) override;
+};
+
+// Why saturation stopped
+enum class StopReason {
+  // An iteration didn't change the e-graph
+  Saturated,
+  IterationLimit,
+  NodeLimit,
+  ClassLimit,
+  TimeLimit,
+  MemoryLimit,
+  // One of the goals of the run has been proven
+  GoalReached,
+};
+
+const char *getStopReasonName(StopReason);
+
+// Bounds on a saturation run. A limit of 0 means unlimited.
+struct RunLimits {
+  unsigned iterations = 10000;
+  unsigned nodes = 0;
+  unsigned classes = 0;
+  // Wall-clock time in seconds
+  double seconds = 0;
+  // Bytes of heap in use by the process
+  size_t memory = 0;
+
+  // Return the limit (other than the iteration limit) that `g` has exceeded
+  // `seconds` into the run, if any
+  std::optional<StopReason> check(const EGraphBase &g, double seconds) const;
+};
+
+struct RunReport {
+  StopReason stopReason;
+  // Number of iterations that ran, including the one that hit a limit
+  unsigned numIterations = 0;
+  unsigned numNodes = 0;
+  unsigned numClasses = 0;
+  double seconds = 0;
+  // Bytes of heap in use by the process at the end
+  size_t memory = 0;
+  // Index of the goal that was reached, if any
+  int goal = -1;
+};
+
+// What happened to a rewrite in one iteration
+struct RuleStats {
+  // False if the scheduler skipped the rewrite
+  bool matched = false;
+  unsigned numMatches = 0;
+  // True if the scheduler dropped the matches
+  bool banned = false;
+};
+
+struct IterationStats {
+  double matchSeconds = 0;
+  double applySeconds = 0;
+  double rebuildSeconds = 0;
+  // One per rewrite
+  std::vector<RuleStats> rules;
+  unsigned nodesAdded = 0;
+  unsigned classesAdded = 0;
+  // Merges done by applying the matches and by rebuilding
+  unsigned numMerges = 0;
+  // Size of the e-graph at the end of the iteration
+  unsigned numNodes = 0;
+  unsigned numClasses = 0;
+};
+
+struct RunStats {
+  std::vector<std::string> ruleNames;
+  std::vector<IterationStats> iterations;
+
+  void writeJSON(llvm::raw_ostream &) const;
+};
+
+// Drives saturation: every iteration matches the rewrites (concurrently),
+// applies the matches, and rebuilds the e-graph, until the e-graph stops
+// changing or a limit is hit. The limits are checked between iterations and
+// while applying matches, in which case the e-graph is still rebuilt before
+// returning. Matching gives up at the time limit, and the (incomplete)
+// matches are dropped.
+template <typename EGraphT> class Runner {
+  EGraphT &g;
+  RunLimits limits;
+  unsigned numThreads = 0;
+  RunStats *stats = nullptr;
+  std::vector<std::function<bool(const EGraphT &)>> goals;
+
+  // Return the first goal that holds, or -1
+  int findReachedGoal() const {
+    for (auto item : llvm::enumerate(goals))
+      if (item.value()(g))
+        return item.index();
+    return -1;
+  }
+
+public:
+  // Number of matches of a rewrite applied between two checks of the limits
+  // and goals
+  static constexpr unsigned ApplyBatchSize = 256;
+
+  Runner(EGraphT &g) : g(g) {}
+  Runner &setIterLimit(unsigned n) { limits.iterations = n; return *this; }
+  Runner &setNodeLimit(unsigned n) { limits.nodes = n; return *this; }
+  Runner &setClassLimit(unsigned n) { limits.classes = n; return *this; }
+  Runner &setTimeLimit(double seconds) { limits.seconds = seconds; return *this; }
+  Runner &setMemoryLimit(size_t bytes) { limits.memory = bytes; return *this; }
+  Runner &setLimits(const RunLimits &limits2) { limits = limits2; return *this; }
+  // Match on `n` threads, all of the hardware threads if 0
+  Runner &setNumThreads(unsigned n) { numThreads = n; return *this; }
+  // Record what every iteration did into `stats`
+  Runner &setStats(RunStats *stats2) { stats = stats2; return *this; }
+  // Stop as soon as `goal` holds. Goals are about which classes are
+  // equivalent, so they are only checked after a batch of matches that merged
+  // classes, and after every rebuild.
+  Runner &addGoal(std::function<bool(const EGraphT &)> goal) {
+    goals.push_back(std::move(goal));
+    return *this;
+  }
+  // Stop as soon as `c1` and `c2` are proven equivalent
+  Runner &addEquivalenceGoal(EClassBase *c1, EClassBase *c2) {
+    ClassId id1 = c1->getId(), id2 = c2->getId();
+    return addGoal(
+        [id1, id2](const EGraphT &g) { return g.isEquivalent(id1, id2); });
+  }
+
+  RunReport run(llvm::ArrayRef<std::unique_ptr<Rewrite<EGraphT>>> rewrites,
+                Scheduler &scheduler);
+  RunReport run(llvm::ArrayRef<std::unique_ptr<Rewrite<EGraphT>>> rewrites) {
+    BackoffScheduler scheduler;
+    return run(rewrites, scheduler);
+  }
+};
+
+template <typename EGraphT>
+RunReport
+Runner<EGraphT>::run(llvm::ArrayRef<std::unique_ptr<Rewrite<EGraphT>>> rewrites,
+                     Scheduler &scheduler) {
+  auto start = std::chrono::steady_clock::now();
+  auto deadline = MatchDeadline::max();
+  if (limits.seconds)
+    deadline = start + std::chrono::duration_cast<MatchDeadline::duration>(
+                           std::chrono::duration<double>(limits.seconds));
+  auto elapsed = [&] {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  };
+  unsigned numRewrites = rewrites.size();
+  scheduler.reset(numRewrites);
+
+  // Mapping rewrite -> the epoch before which all of its matches have been
+  // applied
+  std::vector<unsigned> since(numRewrites, 0);
+  std::vector<int> matchLimits(numRewrites);
+  llvm::ThreadPool pool(llvm::hardware_concurrency(numThreads));
+
+  if (stats) {
+    stats->ruleNames.clear();
+    stats->iterations.clear();
+    for (auto &rw : rewrites)
+      stats->ruleNames.push_back(rw->getName());
+  }
+
+  RunReport report;
+  report.stopReason = StopReason::IterationLimit;
+  for (unsigned i = 0; i < limits.iterations; i++) {
+    if ((report.goal = findReachedGoal()) >= 0) {
+      report.stopReason = StopReason::GoalReached;
+      break;
+    }
+    if (auto reason = limits.check(g, elapsed())) {
+      report.stopReason = *reason;
+      break;
+    }
+    report.numIterations++;
+
+    unsigned size = g.numNodes();
+    ClassId numIds = g.numClassIds();
+    unsigned numMerges = g.numMerges();
+    IterationStats iterStats;
+    iterStats.rules.resize(numRewrites);
+    double lap = elapsed();
+    // One match buffer per rewrite
+    std::vector<MatchBuffer> matches(numRewrites);
+    std::vector<bool> matched(numRewrites, false);
+    for (unsigned j = 0; j < numRewrites; j++) {
+      if (!scheduler.shouldMatch(j, i))
+        continue;
+      matched[j] = true;
+      matchLimits[j] = scheduler.getMatchLimit(j, i);
+      pool.async([&, j] {
+        matches[j] = rewrites[j]->findMatches(g, matchLimits[j], since[j],
+                                              deadline);
+      });
+    }
+    pool.wait();
+    iterStats.matchSeconds = elapsed() - lap;
+    lap += iterStats.matchSeconds;
+    // Don't apply the matches if we've run out of time while matching, they
+    // may be incomplete
+    std::optional<StopReason> stopReason = limits.check(g, elapsed());
+
+    for (unsigned j = 0; j < numRewrites; j++) {
+      if (!matched[j])
         continue;
+      auto &ruleStats = iterStats.rules[j];
+      ruleStats.matched = true;
+      ruleStats.numMatches = matches[j].size();
+      if (!scheduler.shouldApply(j, i, matches[j])) {
+        ruleStats.banned = true;
+        matches[j].clear();
+      } else if (matchLimits[j] <= 0 ||
+                 matches[j].size() < unsigned(matchLimits[j])) {
+        // We've got all the matches, so only look for the new ones next time
+        since[j] = g.getEpoch() + 1;
       }
+    }
+
+    // Everything changed from now on is going to be matched again
+    g.advanceEpoch();
 
-      unsigned threshold = matchLimit << stat.numBans;
-      auto ms = match(rw->sourcePattern(), g, threshold);
-      unsigned totalSize = 0;
-      for (auto &m : ms)
-        totalSize += m.size();
-      if (totalSize > threshold) {
-        stat.bannedUntil = i + (banLen << stat.numBans);
-        stat.numBans++;
-        ms.clear();
+    // Number of merges the last time we checked the goals
+    unsigned checkedMerges = g.numMerges();
+    for (unsigned j = 0; j < numRewrites && !stopReason; j++) {
+      auto &ms = matches[j];
+      for (size_t k = 0; k < ms.size() && !stopReason; k += ApplyBatchSize) {
+        rewrites[j]->applyMatches(ms, g, k, k + ApplyBatchSize);
+        if (g.numMerges() != checkedMerges) {
+          checkedMerges = g.numMerges();
+          if ((report.goal = findReachedGoal()) >= 0) {
+            stopReason = StopReason::GoalReached;
+            break;
+          }
+        }
+        stopReason = limits.check(g, elapsed());
       }
-      matches.push_back(std::move(ms));
     }
+    if (!stopReason)
+      stopReason = limits.check(g, elapsed());
 
-    for (unsigned i = 0, n = rewrites.size(); i < n; i++)
-      rewrites[i]->applyMatches(matches[i], g);
+    iterStats.applySeconds = elapsed() - lap;
+    lap += iterStats.applySeconds;
 
     g.rebuild();
-    if (size == g.numNodes())
+    iterStats.rebuildSeconds = elapsed() - lap;
+    if (stats) {
+      iterStats.nodesAdded = g.numNodes() - size;
+      iterStats.classesAdded = g.numClassIds() - numIds;
+      iterStats.numMerges = g.numMerges() - numMerges;
+      iterStats.numNodes = g.numNodes();
+      iterStats.numClasses = g.numClasses();
+      stats->iterations.push_back(std::move(iterStats));
+    }
+
+    // Rebuilding can prove a goal by congruence
+    if (!stopReason && (report.goal = findReachedGoal()) >= 0)
+      stopReason = StopReason::GoalReached;
+    if (stopReason) {
+      report.stopReason = *stopReason;
       break;
-    llvm::errs() << "???? " << i << ", num classes = " << std::distance(g.class_begin(), g.class_end()) << '\n';
+    }
+    if (size == g.numNodes() && scheduler.canStop(i)) {
+      report.stopReason = StopReason::Saturated;
+      break;
+    }
   }
+
+  report.numNodes = g.numNodes();
+  report.numClasses = g.numClasses();
+  report.seconds = elapsed();
+  report.memory = llvm::sys::Process::GetMallocUsage();
+  return report;
+}
+
+template<typename EGraphT>
+void saturate(llvm::ArrayRef<std::unique_ptr<Rewrite<EGraphT>>> rewrites,
+              EGraphT &g, Scheduler &scheduler, int iters = 10000,
+              unsigned numThreads = 0) {
+  Runner<EGraphT>(g)
+      .setIterLimit(iters)
+      .setNumThreads(numThreads)
+      .run(rewrites, scheduler);
+}
+
+template<typename EGraphT>
+void saturate(llvm::ArrayRef<std::unique_ptr<Rewrite<EGraphT>>> rewrites,
+              EGraphT &g, int iters = 10000, unsigned numThreads = 0) {
+  BackoffScheduler scheduler;
+  saturate(rewrites, g, scheduler, iters, numThreads);
 }
 
 #endif // PATTERN_H
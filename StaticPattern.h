@@ -0,0 +1,277 @@
+#ifndef STATIC_PATTERN_H
+#define STATIC_PATTERN_H
+
+#include "Pattern.h"
+#include <array>
+#include <tuple>
+
+// Patterns whose shape is a type, e.g.,
+//
+//   patternNode<Add>(patternNode<Add>(PatternVar<'a'>(), PatternVar<'b'>()),
+//                    PatternVar<'c'>())
+//
+// so that the compiler generates a matcher specialized to every pattern: the
+// opcodes, arities and operand order are constants, and whether a variable is
+// bound for the first time or has to be checked against an earlier binding is
+// decided at compile time.
+
+// Set of variables, one bit per name
+using VarMask = uint32_t;
+constexpr unsigned NumVarNames = 26;
+
+constexpr unsigned countVars(VarMask vars) {
+  unsigned n = 0;
+  for (; vars; vars &= vars - 1)
+    n++;
+  return n;
+}
+
+template <char Name> struct PatternVar {
+  static_assert(Name >= 'a' && Name <= 'z', "variables are named a-z");
+  static constexpr unsigned Index = Name - 'a';
+  static constexpr VarMask Vars = VarMask(1) << Index;
+  // Number of non-variable pattern nodes
+  static constexpr unsigned NumNodes = 0;
+};
+
+// A constant, whose opcode is only known once the rewrite is created
+template <typename T> struct PatternConst {
+  T value;
+  Opcode opcode = ~0U;
+  static constexpr VarMask Vars = 0;
+  static constexpr unsigned NumNodes = 1;
+};
+
+template <Opcode Op, typename... Operands> struct PatternNode {
+  std::tuple<Operands...> operands;
+  static constexpr VarMask Vars = (VarMask(0) | ... | Operands::Vars);
+  static constexpr unsigned NumNodes = (1 + ... + Operands::NumNodes);
+};
+
+template <Opcode Op, typename... Operands>
+PatternNode<Op, Operands...> patternNode(Operands... operands) {
+  return {std::make_tuple(operands...)};
+}
+
+template <typename T> PatternConst<T> patternConst(T value) { return {value}; }
+
+// Matches a static pattern against every class of an e-graph, producing the
+// same substitutions as MatchProgram does for the equivalent Pattern
+template <typename LHS> class StaticMatcher {
+  const LHS &lhs;
+  llvm::ArrayRef<Pattern *> columns;
+  EGraphBase &g;
+  MatchVisitor visit;
+  // Shared by all of the matchers running the pattern
+  MatchState &state;
+  std::array<EClassBase *, NumVarNames> vars;
+  std::array<EClassBase *, LHS::NumNodes> nodes;
+  static constexpr unsigned NumColumns =
+      LHS::NumNodes + countVars(LHS::Vars);
+
+  bool reachedLimit() const { return state.reachedLimit(); }
+  bool isModified(EClassBase *c) const { return state.isModified(g, c); }
+
+  void outputSubstitution(bool modified) {
+    // Skip the substitutions we've seen before `since`
+    if (!modified || !state.claim())
+      return;
+    // The nodes in pre-order, then the variables by name
+    std::array<EClassBase *, NumColumns> row;
+    std::copy(nodes.begin(), nodes.end(), row.begin());
+    unsigned column = LHS::NumNodes;
+    for (unsigned i = 0; i < NumVarNames; i++)
+      if (LHS::Vars & (VarMask(1) << i))
+        row[column++] = vars[i];
+    state.output(visit, columns, row);
+  }
+
+  // Each match() binds `pat` (with pre-order index `Idx`) to class `c`, given
+  // that the variables in `Bound` are already bound, and calls `k` for every
+  // way of doing so
+  template <unsigned Idx, VarMask Bound, char Name, typename K>
+  void match(const PatternVar<Name> &, EClassBase *c, bool modified, K &&k) {
+    constexpr unsigned I = PatternVar<Name>::Index;
+    if constexpr ((Bound & PatternVar<Name>::Vars) != 0) {
+      if (vars[I] != c)
+        return;
+    } else {
+      vars[I] = c;
+      modified |= isModified(c);
+    }
+    k(modified);
+  }
+
+  template <unsigned Idx, VarMask Bound, typename T, typename K>
+  void match(const PatternConst<T> &pat, EClassBase *c, bool modified, K &&k) {
+    auto *leaves = c->getNodesByOpcode(pat.opcode);
+    if (!leaves || leaves->empty())
+      return;
+    nodes[Idx] = c;
+    k(modified || isModified(c));
+  }
+
+  template <unsigned Idx, VarMask Bound, Opcode Op, typename... Operands,
+            typename K>
+  void match(const PatternNode<Op, Operands...> &pat, EClassBase *c,
+             bool modified, K &&k) {
+    auto *candidates = c->getNodesByOpcode(Op);
+    if (!candidates)
+      return;
+    nodes[Idx] = c;
+    modified |= isModified(c);
+    for (ENode *node : *candidates) {
+      if (reachedLimit())
+        return;
+      if (node->getOperands().size() != sizeof...(Operands))
+        continue;
+      matchOperands<0, Idx + 1, Bound>(pat, node, modified, k);
+    }
+  }
+
+  // Match the operands from the `I`th on, the first of which has pre-order
+  // index `Idx`
+  template <unsigned I, unsigned Idx, VarMask Bound, Opcode Op,
+            typename... Operands, typename K>
+  void matchOperands(const PatternNode<Op, Operands...> &pat, ENode *node,
+                     bool modified, K &&k) {
+    if constexpr (I == sizeof...(Operands)) {
+      k(modified);
+    } else {
+      using OperandT = std::tuple_element_t<I, std::tuple<Operands...>>;
+      auto *c = g.getLeader(node->getOperands()[I]);
+      match<Idx, Bound>(std::get<I>(pat.operands), c, modified,
+                        [&](bool modified) {
+                          matchOperands<I + 1, Idx + OperandT::NumNodes,
+                                        Bound | OperandT::Vars>(pat, node,
+                                                                modified, k);
+                        });
+    }
+  }
+
+public:
+  StaticMatcher(const LHS &lhs, llvm::ArrayRef<Pattern *> columns,
+                EGraphBase &g, MatchVisitor visit, MatchState &state)
+      : lhs(lhs), columns(columns), g(g), visit(visit), state(state) {}
+
+  // Return false if the visitor stopped the enumeration
+  bool run(llvm::iterator_range<EGraphBase::class_iterator> rootClasses) {
+    for (auto *c : rootClasses) {
+      if (reachedLimit())
+        break;
+      match<0, 0>(lhs, c, false,
+                  [&](bool modified) { outputSubstitution(modified); });
+    }
+    return !state.isStopped();
+  }
+};
+
+// A rewrite whose left-hand side is a static pattern. The right-hand side is
+// a dynamic pattern over the same variables, e.g.,
+//
+//   make(Add, PatternVar<'b'>(), PatternVar<'a'>())
+//
+// The rewrite also keeps the equivalent dynamic Pattern of the left-hand side,
+// for the other match engines and for the substitutions.
+template <typename LanguageT, typename LHS>
+class StaticRewrite : public Rewrite<LanguageT> {
+  static_assert(LHS::NumNodes > 0, "the root can't be a variable");
+
+  LHS lhs;
+  std::array<Pattern *, NumVarNames> varPatterns = {};
+  std::array<Pattern *, LHS::NumNodes> nodePatterns = {};
+  // Columns of the matches: the nodes in pre-order, then the variables
+  std::vector<Pattern *> columns;
+
+  // Create the dynamic pattern of `pat`, which has pre-order index `idx`
+  template <char Name> Pattern *buildPattern(PatternVar<Name> &, unsigned) {
+    auto *&pat = varPatterns[PatternVar<Name>::Index];
+    if (!pat)
+      pat = Rewrite<LanguageT>::var();
+    return pat;
+  }
+  template <typename T> Pattern *buildPattern(PatternConst<T> &c, unsigned idx) {
+    c.opcode = l.getConstOpcode(c.value);
+    return nodePatterns[idx] = Rewrite<LanguageT>::match(c.opcode);
+  }
+  template <Opcode Op, typename... Operands>
+  Pattern *buildPattern(PatternNode<Op, Operands...> &pat, unsigned idx) {
+    return buildPattern(pat, idx, std::index_sequence_for<Operands...>());
+  }
+  template <Opcode Op, typename... Operands, size_t... Is>
+  Pattern *buildPattern(PatternNode<Op, Operands...> &pat, unsigned idx,
+                        std::index_sequence<Is...>) {
+    // Pre-order indices of the operands
+    constexpr unsigned NumNodes[] = {0, Operands::NumNodes...};
+    std::array<unsigned, sizeof...(Operands) + 1> operandIdx = {idx + 1};
+    for (unsigned i = 1; i < operandIdx.size(); i++)
+      operandIdx[i] = operandIdx[i - 1] + NumNodes[i];
+    std::array<Pattern *, sizeof...(Operands)> operands = {
+        buildPattern(std::get<Is>(pat.operands), operandIdx[Is])...};
+    return nodePatterns[idx] =
+               Rewrite<LanguageT>::match(Op, std::get<Is>(operands)...);
+  }
+
+protected:
+  LanguageT &l;
+
+  template <char Name> Pattern *resolve(PatternVar<Name>) {
+    static_assert(LHS::Vars & PatternVar<Name>::Vars,
+                  "variable not bound by the left-hand side");
+    return varPatterns[PatternVar<Name>::Index];
+  }
+  Pattern *resolve(Pattern *pat) { return pat; }
+
+  template <typename... ArgTypes>
+  Pattern *make(Opcode opcode, ArgTypes... args) {
+    return Rewrite<LanguageT>::match(opcode, resolve(args)...);
+  }
+  template <typename T> Pattern *constant(T x) {
+    return Rewrite<LanguageT>::match(l.getConstOpcode(x));
+  }
+
+public:
+  StaticRewrite(LanguageT &l, LHS lhs, std::string name) : lhs(lhs), l(l) {
+    this->root = buildPattern(this->lhs, 0);
+    this->name = std::move(name);
+    columns.assign(nodePatterns.begin(), nodePatterns.end());
+    for (auto *var : varPatterns)
+      if (var)
+        columns.push_back(var);
+  }
+
+  MatchBuffer findMatches(EGraphBase &g, int limit = -1, unsigned since = 0,
+                          MatchDeadline deadline = MatchDeadline::max())
+      override {
+    if (this->engine != MatchEngine::Backtracking)
+      return Rewrite<LanguageT>::findMatches(g, limit, since, deadline);
+
+    MatchState state(limit, since, deadline);
+    auto matchChunk =
+        [&](llvm::iterator_range<EGraphBase::class_iterator> rootClasses,
+            MatchVisitor collect) {
+          StaticMatcher<LHS>(lhs, columns, g, collect, state).run(rootClasses);
+        };
+    return matchInChunks(g, columns, state, matchChunk);
+  }
+
+  bool forEachMatch(EGraphBase &g, MatchVisitor visit,
+                    unsigned since = 0) override {
+    if (this->engine != MatchEngine::Backtracking)
+      return Rewrite<LanguageT>::forEachMatch(g, visit, since);
+    MatchState state(-1, since);
+    return StaticMatcher<LHS>(lhs, columns, g, visit, state)
+        .run(llvm::make_range(g.class_begin(), g.class_end()));
+  }
+};
+
+// Define rewrite `RW` of language `LANG` from a static pattern `LHS` to the
+// pattern `RHS`
+#define STATIC_REWRITE(LANG, RW, LHS, RHS)                                     \
+  struct RW : public StaticRewrite<LANG, decltype(LHS)> {                      \
+    RW(LANG &l) : StaticRewrite<LANG, decltype(LHS)>(l, LHS, #RW) {            \
+      rhs = resolve(RHS);                                                      \
+    }                                                                          \
+  };
+
+#endif // STATIC_PATTERN_H
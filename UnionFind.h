@@ -0,0 +1,61 @@
+#ifndef UNION_FIND_H
+#define UNION_FIND_H
+
+#include <cassert>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Disjoint sets over dense ids [0, size()), stored as flat arrays.
+// Union by size keeps the trees shallow and `find` halves the path it walks.
+class UnionFind {
+  std::vector<uint32_t> parent;
+  // Number of elements in the set, only meaningful for roots
+  std::vector<uint32_t> setSize;
+
+public:
+  uint32_t makeSet() {
+    uint32_t id = parent.size();
+    parent.push_back(id);
+    setSize.push_back(1);
+    return id;
+  }
+
+  uint32_t size() const { return parent.size(); }
+
+  bool isRoot(uint32_t id) const { return parent[id] == id; }
+
+  uint32_t find(uint32_t id) {
+    assert(id < parent.size());
+    while (parent[id] != id) {
+      // Path halving: point every other node on the path to its grandparent
+      parent[id] = parent[parent[id]];
+      id = parent[id];
+    }
+    return id;
+  }
+
+  // Same as `find` but without compressing the path
+  uint32_t find(uint32_t id) const {
+    assert(id < parent.size());
+    while (parent[id] != id)
+      id = parent[id];
+    return id;
+  }
+
+  // Merge the sets containing `a` and `b` and return the root of the union.
+  // The root of the larger set becomes the root of the union.
+  uint32_t unite(uint32_t a, uint32_t b) {
+    a = find(a);
+    b = find(b);
+    if (a == b)
+      return a;
+    if (setSize[a] < setSize[b])
+      std::swap(a, b);
+    parent[b] = a;
+    setSize[a] += setSize[b];
+    return a;
+  }
+};
+
+#endif // UNION_FIND_H
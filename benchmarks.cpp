@@ -0,0 +1,280 @@
+#include "EGraph.h"
+#include "Extractor.h"
+#include "Halide.h"
+#include "Pattern.h"
+#include "benchmark/benchmark.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <random>
+
+// Microbenchmarks of the core e-graph operations. The synthetic workloads are
+// built from a fixed seed so that runs are comparable.
+
+namespace {
+
+// Every leaf gets its own opcode from `FirstLeaf` on
+enum : Opcode { F, G, FirstLeaf };
+
+// Allocations made through the global operator new (see the end of the file)
+// while `countingAllocations` is set, from any thread
+std::atomic<bool> countingAllocations{false};
+std::atomic<int64_t> numAllocs{0};
+std::atomic<int64_t> allocatedBytes{0};
+
+// Count what the global operator new allocates in the sections passed to
+// countAllocations(). Google Benchmark only starts it for a separate run after
+// the timed one, so the counting never shows up in the timings. The results
+// are in the JSON output (--benchmark_format=json) as allocs_per_iter and
+// total_allocated_bytes, the latter summed over the iterations of that run.
+class AllocationCounter : public benchmark::MemoryManager {
+public:
+  static bool active;
+
+  void Start() override {
+    numAllocs = 0;
+    allocatedBytes = 0;
+    active = true;
+  }
+  void Stop(Result &result) override {
+    active = false;
+    result.num_allocs = numAllocs;
+    result.total_allocated_bytes = allocatedBytes;
+  }
+  void Stop(Result *result) override { Stop(*result); }
+};
+bool AllocationCounter::active = false;
+
+// Run `fn`, the part of a benchmark iteration whose allocations are reported
+template <typename FnTy> void countAllocations(FnTy fn) {
+  if (!AllocationCounter::active)
+    return fn();
+  countingAllocations = true;
+  fn();
+  countingAllocations = false;
+}
+
+// `numLeaves` leaves and `numNodes` binary nodes over random earlier classes
+std::vector<EClassBase *> buildRandomGraph(BasicEGraph &g, unsigned numLeaves,
+                                           unsigned numNodes,
+                                           std::mt19937 &rng) {
+  std::vector<EClassBase *> classes;
+  for (unsigned i = 0; i < numLeaves; i++)
+    classes.push_back(g.make(FirstLeaf + i));
+  for (unsigned i = 0; i < numNodes; i++) {
+    std::uniform_int_distribution<unsigned> pick(0, classes.size() - 1);
+    auto *a = classes[pick(rng)];
+    auto *b = classes[pick(rng)];
+    classes.push_back(g.make(i % 2 ? F : G, {a, b}));
+  }
+  return classes;
+}
+
+// Merge `density` percent of the leaves into random other leaves
+void mergeLeaves(BasicEGraph &g, llvm::ArrayRef<EClassBase *> classes,
+                 unsigned numLeaves, unsigned density, std::mt19937 &rng) {
+  std::uniform_int_distribution<unsigned> pick(0, numLeaves - 1);
+  unsigned numMerges = numLeaves * density / 100;
+  for (unsigned i = 0; i < numMerges; i++)
+    g.merge(classes[pick(rng)], classes[pick(rng)]);
+}
+
+// (v0 + v1 + ... + vn) - (vn + ... + v0)
+EClassBase *buildHalideSum(HalideTRS &h, unsigned n) {
+  auto *lhs = h.var("v0");
+  auto *rhs = h.var("v" + std::to_string(n - 1));
+  for (unsigned i = 1; i < n; i++) {
+    lhs = h.add(lhs, h.var("v" + std::to_string(i)));
+    rhs = h.add(rhs, h.var("v" + std::to_string(n - 1 - i)));
+  }
+  return h.sub(lhs, rhs);
+}
+
+void BM_Make(benchmark::State &state) {
+  unsigned n = state.range(0);
+  std::unique_ptr<BasicEGraph> g;
+  for (auto _ : state) {
+    // Don't time tearing down the last e-graph
+    state.PauseTiming();
+    std::mt19937 rng(0);
+    g = std::make_unique<BasicEGraph>();
+    state.ResumeTiming();
+    countAllocations([&] { buildRandomGraph(*g, n / 4, n, rng); });
+  }
+  state.SetItemsProcessed(state.iterations() * (n + n / 4));
+}
+BENCHMARK(BM_Make)->RangeMultiplier(4)->Range(1 << 10, 1 << 16);
+
+void BM_Merge(benchmark::State &state) {
+  unsigned n = state.range(0);
+  unsigned density = state.range(1);
+  std::unique_ptr<BasicEGraph> g;
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::mt19937 rng(0);
+    g = std::make_unique<BasicEGraph>();
+    auto classes = buildRandomGraph(*g, n / 4, n, rng);
+    state.ResumeTiming();
+    countAllocations([&] { mergeLeaves(*g, classes, n / 4, density, rng); });
+  }
+  state.SetItemsProcessed(state.iterations() * (n / 4 * density / 100));
+}
+BENCHMARK(BM_Merge)
+    ->ArgsProduct({{1 << 12, 1 << 16}, {1, 10, 50}});
+
+void BM_Rebuild(benchmark::State &state) {
+  unsigned n = state.range(0);
+  unsigned density = state.range(1);
+  std::unique_ptr<BasicEGraph> g;
+  for (auto _ : state) {
+    state.PauseTiming();
+    std::mt19937 rng(0);
+    g = std::make_unique<BasicEGraph>();
+    auto classes = buildRandomGraph(*g, n / 4, n, rng);
+    mergeLeaves(*g, classes, n / 4, density, rng);
+    state.ResumeTiming();
+    countAllocations([&] { g->rebuild(); });
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_Rebuild)
+    ->ArgsProduct({{1 << 12, 1 << 16}, {1, 10, 50}})
+    ->Unit(benchmark::kMillisecond);
+
+// Match f(g(x, y), z) on a rebuilt random graph
+void BM_Match(benchmark::State &state) {
+  unsigned n = state.range(0);
+  unsigned density = state.range(1);
+  std::mt19937 rng(0);
+  BasicEGraph g;
+  auto classes = buildRandomGraph(g, n / 4, n, rng);
+  mergeLeaves(g, classes, n / 4, density, rng);
+  g.rebuild();
+
+  Pattern *x = Pattern::var(), *y = Pattern::var(), *z = Pattern::var();
+  Pattern *pat = Pattern::make(F, {Pattern::make(G, {x, y}), z});
+  size_t numMatches = 0;
+  for (auto _ : state) {
+    MatchBuffer matches;
+    countAllocations([&] { matches = match(pat, g); });
+    numMatches = matches.size();
+  }
+  state.SetItemsProcessed(state.iterations() * numMatches);
+  state.counters["matches"] = numMatches;
+}
+BENCHMARK(BM_Match)
+    ->ArgsProduct({{1 << 12, 1 << 16}, {0, 10}})
+    ->Unit(benchmark::kMillisecond);
+
+// Count the matches of BM_Match with a visitor instead of materializing them.
+// The pattern is compiled once, so only the enumeration is measured.
+void BM_MatchCount(benchmark::State &state) {
+  unsigned n = state.range(0);
+  std::mt19937 rng(0);
+  BasicEGraph g;
+  buildRandomGraph(g, n / 4, n, rng);
+  g.rebuild();
+
+  Pattern *x = Pattern::var(), *y = Pattern::var(), *z = Pattern::var();
+  Pattern *pat = Pattern::make(F, {Pattern::make(G, {x, y}), z});
+  MatchProgram prog(pat);
+  size_t numMatches = 0;
+  for (auto _ : state) {
+    numMatches = 0;
+    countAllocations([&] {
+      prog.run(g, [&](auto, auto) {
+        numMatches++;
+        return true;
+      });
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * numMatches);
+  state.counters["matches"] = numMatches;
+}
+BENCHMARK(BM_MatchCount)
+    ->Arg(1 << 12)
+    ->Arg(1 << 16)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_SaturateHalide(benchmark::State &state) {
+  unsigned n = state.range(0);
+  unsigned numNodes = 0;
+  std::unique_ptr<HalideTRS> h;
+  for (auto _ : state) {
+    state.PauseTiming();
+    h = std::make_unique<HalideTRS>();
+    buildHalideSum(*h, n);
+    auto rewrites = getRewrites(*h);
+    state.ResumeTiming();
+    countAllocations([&] {
+      Runner<HalideTRS>(*h).setIterLimit(4).run(rewrites);
+    });
+    numNodes = h->numNodes();
+  }
+  state.SetItemsProcessed(state.iterations() * numNodes);
+}
+BENCHMARK(BM_SaturateHalide)
+    ->DenseRange(2, 6, 2)
+    ->Unit(benchmark::kMillisecond);
+
+void BM_Extract(benchmark::State &state) {
+  unsigned n = state.range(0);
+  HalideTRS h;
+  auto *root = buildHalideSum(h, n);
+  Runner<HalideTRS>(h).setIterLimit(4).run(getRewrites(h));
+
+  for (auto _ : state) {
+    Extractor::Result result;
+    countAllocations(
+        [&] { result = Extractor(h).extract(h.getLeader(root)); });
+  }
+  state.SetItemsProcessed(state.iterations() * h.numNodes());
+}
+BENCHMARK(BM_Extract)->DenseRange(2, 6, 2)->Unit(benchmark::kMicrosecond);
+
+// Extract every class of a saturated e-graph, one at a time (0) or at once (1)
+void BM_ExtractAll(benchmark::State &state) {
+  HalideTRS h;
+  buildHalideSum(h, 4);
+  Runner<HalideTRS>(h).setIterLimit(4).run(getRewrites(h));
+  std::vector<EClassBase *> roots(h.class_begin(), h.class_end());
+
+  for (auto _ : state) {
+    countAllocations([&] {
+      Extractor extractor(h);
+      if (state.range(0)) {
+        benchmark::DoNotOptimize(extractor.extract(roots));
+        return;
+      }
+      for (auto *c : roots)
+        benchmark::DoNotOptimize(extractor.extract(c));
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * roots.size());
+}
+BENCHMARK(BM_ExtractAll)->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+} // namespace
+
+void *operator new(size_t size) {
+  if (countingAllocations.load(std::memory_order_relaxed)) {
+    numAllocs.fetch_add(1, std::memory_order_relaxed);
+    allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+  }
+  if (void *p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+int main(int argc, char **argv) {
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    return 1;
+  AllocationCounter counter;
+  benchmark::RegisterMemoryManager(&counter);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::RegisterMemoryManager(nullptr);
+  benchmark::Shutdown();
+}
@@ -0,0 +1,115 @@
+#include "Halide.h"
+#include "Pattern.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Try to prove every expression of a Caviar-style corpus (see corpus/) by
+// saturating it with the Halide rewrites, and report how each one went as CSV.
+
+using namespace llvm;
+
+static cl::opt<std::string> CorpusPath(cl::Positional, cl::Required,
+                                       cl::desc("<corpus>"));
+static cl::opt<std::string> OutputPath("o", cl::init("-"),
+                                       cl::desc("Where to write the report"));
+static cl::opt<unsigned> IterLimit("iter-limit", cl::init(30),
+                                   cl::desc("Iterations per expression"));
+static cl::opt<unsigned> NodeLimit("node-limit", cl::init(10000),
+                                   cl::desc("E-nodes per expression"));
+static cl::opt<double> TimeLimit("time-limit", cl::init(3),
+                                 cl::desc("Seconds per expression"));
+static cl::opt<bool> StopAtGoal(
+    "stop-at-goal", cl::init(true),
+    cl::desc("Stop as soon as an expression is proven true or false"));
+static cl::opt<unsigned> NumThreads("threads", cl::init(0),
+                                    cl::desc("Matching threads (0 = all)"));
+
+namespace {
+enum class Result { True, False, Unknown, Invalid };
+
+const char *getResultName(Result result) {
+  switch (result) {
+  case Result::True:
+    return "true";
+  case Result::False:
+    return "false";
+  case Result::Unknown:
+    return "unknown";
+  case Result::Invalid:
+    return "invalid";
+  }
+  llvm_unreachable("unknown result");
+}
+} // namespace
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Caviar proving benchmark\n");
+
+  auto buf = MemoryBuffer::getFileOrSTDIN(CorpusPath);
+  if (!buf) {
+    errs() << "Can't read " << CorpusPath << ": " << buf.getError().message()
+           << '\n';
+    return 1;
+  }
+  std::error_code ec;
+  raw_fd_ostream os(OutputPath, ec);
+  if (ec) {
+    errs() << "Can't open " << OutputPath << ": " << ec.message() << '\n';
+    return 1;
+  }
+
+  RunLimits limits;
+  limits.iterations = IterLimit;
+  limits.nodes = NodeLimit;
+  limits.seconds = TimeLimit;
+
+  os << "id,result,seconds,nodes,classes,iterations,stop_reason,expr\n";
+  unsigned numExprs = 0, numProven = 0;
+  double totalSeconds = 0;
+  SmallVector<StringRef> lines;
+  (*buf)->getBuffer().split(lines, '\n', -1, false);
+  for (StringRef line : lines) {
+    line = line.trim();
+    if (line.empty() || line.startswith("#"))
+      continue;
+    unsigned id = numExprs++;
+
+    HalideTRS h;
+    auto *root = parseHalideExpr(h, line);
+    if (!root) {
+      os << id << ',' << getResultName(Result::Invalid) << ",,,,,,\"" << line
+         << "\"\n";
+      continue;
+    }
+    auto *t = h.constant(1);
+    auto *f = h.constant(0);
+    Runner<HalideTRS> runner(h);
+    runner.setLimits(limits).setNumThreads(NumThreads);
+    if (StopAtGoal)
+      runner.addEquivalenceGoal(root, t).addEquivalenceGoal(root, f);
+    auto rewrites = getRewrites(h);
+    auto report = runner.run(rewrites);
+
+    Result result = Result::Unknown;
+    if (h.isEquivalent(root, t))
+      result = Result::True;
+    else if (h.isEquivalent(root, f))
+      result = Result::False;
+    if (result != Result::Unknown)
+      numProven++;
+    totalSeconds += report.seconds;
+
+    // The e-graph never shrinks, so its final size is also the peak
+    os << id << ',' << getResultName(result) << ','
+       << format("%.4f", report.seconds) << ','
+       << report.numNodes << ',' << report.numClasses << ','
+       << report.numIterations << ',' << getStopReasonName(report.stopReason)
+       << ",\"" << line << "\"\n";
+  }
+
+  errs() << "Proved " << numProven << " of " << numExprs << " expressions in "
+         << format("%.2f", totalSeconds) << "s\n";
+  return 0;
+}
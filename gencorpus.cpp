@@ -0,0 +1,188 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <random>
+#include <string>
+
+// Generate a Caviar-style corpus (see corpus/) of random Halide conditions in
+// the prefix syntax caviar reads. About half of the conditions are equalities
+// between a random expression and a copy of it rewritten with a few identities,
+// so they are true by construction. The rest compare or combine unrelated
+// random expressions, which are rarely true or false for every value of the
+// variables.
+
+using namespace llvm;
+
+static cl::opt<unsigned> NumExprs("n", cl::init(4000),
+                                  cl::desc("Number of conditions"));
+static cl::opt<unsigned> Seed("seed", cl::init(0), cl::desc("Random seed"));
+static cl::opt<unsigned> NumVars("vars", cl::init(4),
+                                 cl::desc("Variables per condition"));
+static cl::opt<unsigned> MaxDepth("depth", cl::init(3),
+                                  cl::desc("Depth of the random expressions"));
+static cl::opt<unsigned> NumSteps(
+    "steps", cl::init(3),
+    cl::desc("Identities applied to the right-hand side of an equality"));
+
+namespace {
+struct Expr;
+using ExprPtr = std::shared_ptr<Expr>;
+
+// A constant or variable if `op` is empty, a binary operation otherwise
+struct Expr {
+  std::string op;
+  std::string leaf;
+  ExprPtr lhs, rhs;
+
+  bool isLeaf() const { return op.empty(); }
+  bool isConstant() const { return isLeaf() && leaf[0] != 'v'; }
+  void print(raw_ostream &os) const {
+    if (isLeaf()) {
+      os << leaf;
+      return;
+    }
+    os << '(' << op << ' ';
+    lhs->print(os);
+    os << ' ';
+    rhs->print(os);
+    os << ')';
+  }
+};
+
+ExprPtr makeLeaf(std::string leaf) {
+  auto e = std::make_shared<Expr>();
+  e->leaf = std::move(leaf);
+  return e;
+}
+ExprPtr makeConstant(int x) { return makeLeaf(std::to_string(x)); }
+ExprPtr makeOp(std::string op, ExprPtr lhs, ExprPtr rhs) {
+  auto e = std::make_shared<Expr>();
+  e->op = std::move(op);
+  e->lhs = std::move(lhs);
+  e->rhs = std::move(rhs);
+  return e;
+}
+
+class Generator {
+  std::mt19937 rng;
+
+  unsigned pick(unsigned n) {
+    return std::uniform_int_distribution<unsigned>(0, n - 1)(rng);
+  }
+  bool coin(unsigned percent) { return pick(100) < percent; }
+  int smallConstant() { return int(pick(33)) - 16; }
+
+public:
+  explicit Generator(unsigned seed) : rng(seed) {}
+
+  // A random integer expression of at most `depth` operations deep
+  ExprPtr arith(unsigned depth) {
+    if (depth == 0 || coin(25)) {
+      if (coin(70))
+        return makeLeaf("v" + std::to_string(pick(NumVars)));
+      return makeConstant(smallConstant());
+    }
+    // The operands are drawn one at a time, in order, so that the output
+    // doesn't depend on the evaluation order of function arguments
+    static const char *ops[] = {"+", "+", "-", "-", "*", "min", "max"};
+    unsigned i = pick(std::size(ops) + 2);
+    auto lhs = arith(depth - 1);
+    // Halide divides and takes remainders by constants most of the time
+    if (i >= std::size(ops))
+      return makeOp(i == std::size(ops) ? "/" : "%", lhs,
+                    makeConstant(2 + pick(15)));
+    // Keep products linear, like most of Halide's index arithmetic
+    if (std::string(ops[i]) == "*")
+      return makeOp("*", lhs, makeConstant(smallConstant()));
+    return makeOp(ops[i], lhs, arith(depth - 1));
+  }
+
+  // `e` rewritten at a random position with an identity that holds for all
+  // values of the variables
+  ExprPtr mutate(const ExprPtr &e) {
+    if (!e->isLeaf() && coin(60)) {
+      if (coin(50))
+        return makeOp(e->op, mutate(e->lhs), e->rhs);
+      return makeOp(e->op, e->lhs, mutate(e->rhs));
+    }
+    const std::string &op = e->op;
+    bool commutative = op == "+" || op == "*" || op == "min" || op == "max";
+    switch (pick(6)) {
+    case 0:
+      if (commutative)
+        return makeOp(op, e->rhs, e->lhs);
+      break;
+    case 1:
+      // (a + b) + c -> a + (b + c)
+      if (op == "+" && e->lhs->op == "+")
+        return makeOp("+", e->lhs->lhs, makeOp("+", e->lhs->rhs, e->rhs));
+      break;
+    case 2:
+      // a - b -> a + (b * -1)
+      if (op == "-")
+        return makeOp("+", e->lhs, makeOp("*", e->rhs, makeConstant(-1)));
+      break;
+    case 3:
+      // (a + b) * c -> (a * c) + (b * c)
+      if (op == "*" && e->lhs->op == "+")
+        return makeOp("+", makeOp("*", e->lhs->lhs, e->rhs),
+                      makeOp("*", e->lhs->rhs, e->rhs));
+      break;
+    case 4:
+      // c -> c1 + c2
+      if (e->isConstant()) {
+        int c = std::stoi(e->leaf), c1 = smallConstant();
+        return makeOp("+", makeConstant(c1), makeConstant(c - c1));
+      }
+      break;
+    }
+    // a -> (a + x) - x, a + 0 or a * 1
+    switch (pick(3)) {
+    case 0: {
+      auto x = arith(1);
+      return makeOp("-", makeOp("+", e, x), x);
+    }
+    case 1:
+      return makeOp("+", e, makeConstant(0));
+    default:
+      return makeOp("*", e, makeConstant(1));
+    }
+  }
+
+  ExprPtr condition() {
+    if (coin(50)) {
+      auto lhs = arith(MaxDepth);
+      auto rhs = lhs;
+      for (unsigned i = 0; i < NumSteps; i++)
+        rhs = mutate(rhs);
+      return makeOp("==", lhs, rhs);
+    }
+    static const char *cmps[] = {"<", "<=", ">", ">=", "==", "!="};
+    auto compare = [&] {
+      const char *cmp = cmps[pick(std::size(cmps))];
+      auto lhs = arith(MaxDepth);
+      return makeOp(cmp, lhs, arith(MaxDepth));
+    };
+    if (coin(75))
+      return compare();
+    const char *op = coin(50) ? "&&" : "||";
+    auto lhs = compare();
+    return makeOp(op, lhs, compare());
+  }
+};
+} // namespace
+
+int main(int argc, char **argv) {
+  cl::ParseCommandLineOptions(argc, argv, "Caviar corpus generator\n");
+  Generator gen(Seed);
+  outs() << "# Random Caviar-style conditions to measure the throughput of "
+            "caviar, generated by\n"
+         << "# gencorpus -n " << NumExprs << " -seed " << Seed << " -vars "
+         << NumVars << " -depth " << MaxDepth << " -steps " << NumSteps
+         << "\n";
+  for (unsigned i = 0; i < NumExprs; i++) {
+    gen.condition()->print(outs());
+    outs() << '\n';
+  }
+  return 0;
+}
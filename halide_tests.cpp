@@ -1,6 +1,7 @@
 #include "Halide.h"
 #include "Extractor.h"
 #include "gtest/gtest.h"
+#include "llvm/Support/JSON.h"
 
 TEST(HalideTest, simple) {
   HalideTRS h;
@@ -30,6 +31,18 @@ TEST(HalideTest, simplify) {
   ASSERT_TRUE(h.isEquivalent(t1, t2));
 }
 
+TEST(HalideTest, simplify_generic_join) {
+  HalideTRS h;
+
+  auto *t1 = h.add(h.add(h.var("x"), h.constant(1)), h.constant(1));
+  auto *t2 = h.add(h.var("x"), h.constant(2));
+  auto rewrites = getRewrites(h);
+  for (auto &rw : rewrites)
+    rw->setMatchEngine(MatchEngine::GenericJoin);
+  saturate<HalideTRS>(rewrites, h);
+  ASSERT_TRUE(h.isEquivalent(t1, t2));
+}
+
 TEST(HalideTest, add_zero) {
   HalideTRS h;
   auto *t = h.add(h.constant(0), h.var("x"));
@@ -50,13 +63,283 @@ TEST(HalideTest, caviar_test) {
 }
 #endif
 
+TEST(HalideTest, parallel_match) {
+  auto numClasses = [](unsigned numThreads) {
+    HalideTRS h;
+    auto *v0 = h.var("v0");
+    auto *v1 = h.var("v1");
+    auto *a = h.sub(h.add(v0, v1), h.constant(16));
+    auto *b = h.sub(h.add(a, h.constant(143)), h.constant(1));
+    h.eq(a, b);
+    saturate<HalideTRS>(getRewrites(h), h, 4, numThreads);
+    return std::distance(h.class_begin(), h.class_end());
+  };
+  ASSERT_EQ(numClasses(1), numClasses(4));
+}
+
+// The rewrites match their static patterns with specialized matchers, which
+// must agree with the match program of the equivalent dynamic pattern
+TEST(HalideTest, static_match) {
+  HalideTRS h;
+  auto *v0 = h.var("v0");
+  auto *v1 = h.var("v1");
+  auto *a = h.sub(h.add(v0, v1), h.constant(16));
+  auto *b = h.sub(h.add(a, h.constant(143)), h.constant(1));
+  h.eq(a, b);
+  h.eq(h.add(h.div(v0, h.constant(2)), h.mod(v0, h.constant(2))), v1);
+  auto rewrites = getRewrites(h);
+  Runner<HalideTRS>(h).setIterLimit(2).run(rewrites);
+  unsigned since = h.getEpoch();
+  h.advanceEpoch();
+  h.merge(v0, h.constant(0));
+  h.rebuild();
+
+  using Match = std::vector<std::pair<Pattern *, EClassBase *>>;
+  auto normalize = [](const MatchBuffer &buffer) {
+    std::vector<Match> matches;
+    for (size_t i = 0; i < buffer.size(); i++) {
+      auto &m = matches.emplace_back();
+      for (auto [pat, c] : llvm::zip(buffer.getPatterns(), buffer[i]))
+        m.emplace_back(pat, c);
+      llvm::sort(m);
+    }
+    llvm::sort(matches);
+    return matches;
+  };
+  unsigned numMatches = 0;
+  for (auto &rw : rewrites) {
+    for (unsigned s : {0U, since + 1}) {
+      auto expected = normalize(
+          match(rw->sourcePattern(), h, -1, MatchEngine::Backtracking, s));
+      EXPECT_EQ(normalize(rw->findMatches(h, -1, s)), expected)
+          << rw->getName();
+      numMatches += expected.size();
+    }
+    EXPECT_EQ(rw->findMatches(h, 3).size(),
+              std::min<size_t>(3, match(rw->sourcePattern(), h).size()));
+    // Streamed in the same order as a sequential run
+    auto matches = rw->findMatches(h);
+    size_t numVisited = 0;
+    EXPECT_TRUE(rw->forEachMatch(h, [&](auto, llvm::ArrayRef<EClassBase *> row) {
+      EXPECT_EQ(row, matches[numVisited]);
+      numVisited++;
+      return true;
+    }));
+    EXPECT_EQ(numVisited, matches.size());
+  }
+  EXPECT_GT(numMatches, 0u);
+}
+
+TEST(HalideTest, runner) {
+  HalideTRS h;
+  auto *t = h.add(h.add(h.var("x"), h.constant(1)), h.constant(1));
+  auto report = Runner<HalideTRS>(h).run(getRewrites(h));
+  ASSERT_EQ(report.stopReason, StopReason::Saturated);
+  ASSERT_TRUE(h.isEquivalent(t, h.add(h.var("x"), h.constant(2))));
+  ASSERT_EQ(report.numNodes, h.numNodes());
+  ASSERT_EQ(report.numClasses, std::distance(h.class_begin(), h.class_end()));
+}
+
+TEST(HalideTest, runner_limits) {
+  // Most nodes a single match can add
+  unsigned maxRHSNodes = 0;
+  auto run = [&](RunLimits limits) {
+    HalideTRS h;
+    auto *v0 = h.var("v0");
+    auto *v1 = h.var("v1");
+    auto *a = h.sub(h.add(v0, v1), h.constant(16));
+    auto *b = h.sub(h.add(a, h.constant(143)), h.constant(1));
+    h.eq(a, b);
+    auto rewrites = getRewrites(h);
+    for (auto &rw : rewrites)
+      maxRHSNodes = std::max<unsigned>(
+          maxRHSNodes,
+          RHSProgram(rw->targetPattern()).getInstructions().size());
+    auto report = Runner<HalideTRS>(h).setLimits(limits).run(rewrites);
+    // The e-graph is rebuilt even if we stop in the middle of an iteration
+    EXPECT_EQ(report.numClasses, std::distance(h.class_begin(), h.class_end()));
+    return report;
+  };
+
+  RunLimits limits;
+  limits.iterations = 2;
+  auto report = run(limits);
+  ASSERT_EQ(report.stopReason, StopReason::IterationLimit);
+  ASSERT_EQ(report.numIterations, 2);
+
+  limits = RunLimits();
+  limits.nodes = 200;
+  report = run(limits);
+  ASSERT_EQ(report.stopReason, StopReason::NodeLimit);
+  ASSERT_GT(report.numNodes, 200);
+  // Overshoots by at most a batch of matches
+  ASSERT_LE(report.numNodes,
+            200 + Runner<HalideTRS>::ApplyBatchSize * maxRHSNodes);
+
+  limits = RunLimits();
+  limits.classes = 100;
+  ASSERT_EQ(run(limits).stopReason, StopReason::ClassLimit);
+
+  limits = RunLimits();
+  limits.seconds = 1e-9;
+  ASSERT_EQ(run(limits).stopReason, StopReason::TimeLimit);
+
+  // Let the heap grow by 4MB at most
+  limits = RunLimits();
+  limits.memory = llvm::sys::Process::GetMallocUsage() + (4 << 20);
+  report = run(limits);
+  ASSERT_EQ(report.stopReason, StopReason::MemoryLimit);
+  ASSERT_GT(report.numIterations, 1);
+}
+
+TEST(HalideTest, runner_goal) {
+  auto run = [](bool stopAtGoal) {
+    HalideTRS h;
+    auto *t = parseHalideExpr(h, "(== (- (+ v0 8) (+ v0 3)) 5)");
+    auto *one = h.constant(1);
+    Runner<HalideTRS> runner(h);
+    runner.setIterLimit(8);
+    if (stopAtGoal)
+      runner.addGoal([&](const HalideTRS &h) { return false; })
+          .addEquivalenceGoal(t, one);
+    auto report = runner.run(getRewrites(h));
+    EXPECT_TRUE(h.isEquivalent(t, one));
+    return report;
+  };
+  auto report = run(true);
+  ASSERT_EQ(report.stopReason, StopReason::GoalReached);
+  ASSERT_EQ(report.goal, 1);
+  ASSERT_LT(report.numNodes, run(false).numNodes);
+
+  // Goals that hold from the start end the run right away
+  HalideTRS h;
+  auto *x = h.var("x");
+  report = Runner<HalideTRS>(h).addEquivalenceGoal(x, x).run(getRewrites(h));
+  ASSERT_EQ(report.stopReason, StopReason::GoalReached);
+  ASSERT_EQ(report.numIterations, 0);
+}
+
+TEST(HalideTest, run_stats) {
+  HalideTRS h;
+  auto *t = h.add(h.add(h.var("x"), h.constant(1)), h.constant(1));
+  RunStats stats;
+  auto report = Runner<HalideTRS>(h).setStats(&stats).run(getRewrites(h));
+  ASSERT_EQ(stats.iterations.size(), report.numIterations);
+  ASSERT_EQ(stats.ruleNames.size(), getRewrites(h).size());
+  ASSERT_EQ(stats.iterations.back().numNodes, h.numNodes());
+  // The last iteration didn't change anything
+  ASSERT_EQ(stats.iterations.back().nodesAdded, 0);
+  ASSERT_EQ(stats.iterations.back().numMerges, 0);
+  unsigned numMatches = 0, numMerges = 0;
+  for (auto &iter : stats.iterations) {
+    numMerges += iter.numMerges;
+    for (auto &rule : iter.rules)
+      numMatches += rule.numMatches;
+  }
+  ASSERT_GT(numMatches, 0);
+  ASSERT_EQ(numMerges, h.numMerges());
+
+  std::string json;
+  llvm::raw_string_ostream os(json);
+  stats.writeJSON(os);
+  auto parsed = llvm::json::parse(os.str());
+  ASSERT_TRUE(bool(parsed));
+  ASSERT_EQ(parsed->getAsArray()->size(), stats.iterations.size());
+  ASSERT_TRUE(h.isEquivalent(t, h.add(h.var("x"), h.constant(2))));
+}
+
+TEST(HalideTest, parse) {
+  HalideTRS h;
+  auto *t = parseHalideExpr(h, "(== (- (+ v0 v1) 16) (+ v1 -3))");
+  ASSERT_TRUE(t);
+  auto *v0 = h.var("v0");
+  auto *v1 = h.var("v1");
+  ASSERT_EQ(t, h.eq(h.sub(h.add(v0, v1), h.constant(16)),
+                    h.add(v1, h.constant(-3))));
+  ASSERT_EQ(parseHalideExpr(h, " v0 "), v0);
+
+  ASSERT_FALSE(parseHalideExpr(h, ""));
+  ASSERT_FALSE(parseHalideExpr(h, "(+ v0 v1"));
+  ASSERT_FALSE(parseHalideExpr(h, "(+ v0 v1))"));
+  ASSERT_FALSE(parseHalideExpr(h, "(+ v0)"));
+  ASSERT_FALSE(parseHalideExpr(h, "(select v0 v1 v2)"));
+}
+
 TEST(HalideTest, extract_simple) {
   HalideTRS h;
   auto *t = h.add(h.constant(0), h.var("x"));
   saturate<HalideTRS>(getRewrites(h), h);
-  auto extracted = Extractor().extract(t);
-  auto *node = extracted.lookup(t->getLeader());
+  auto extracted = Extractor(h).extract(t);
+  auto *node = extracted.lookup(h.getLeader(t));
   ASSERT_TRUE(node);
   ASSERT_EQ(node->getOperands().size(), 0);
   ASSERT_EQ(node->getOpcode(), h.getVariableOpcode("x"));
 }
+
+TEST(HalideTest, extract_latency) {
+  HalideTRS h;
+  // x * 2 = x + x
+  auto *t = parseHalideExpr(h, "(* v0 2)");
+  h.merge(t, parseHalideExpr(h, "(+ v0 v0)"));
+  h.rebuild();
+  auto size = Extractor(h).extract(t);
+  auto latency = Extractor(h, getHalideCostModel()).extract(t);
+  ASSERT_EQ(size.lookup(h.getLeader(t))->getOpcode(), h.getOpcode("*"));
+  ASSERT_EQ(latency.lookup(h.getLeader(t))->getOpcode(), h.getOpcode("+"));
+}
+
+TEST(HalideTest, extract_dag) {
+  HalideTRS h;
+  auto *t = parseHalideExpr(h, "(* (+ v0 v1) (+ (+ v0 v1) 1))");
+  saturate<HalideTRS>(getRewrites(h), h, 3);
+  Extractor extractor(h);
+  auto tree = extractor.extract(t);
+  auto dag = extractor.extractDAG(t, 0.1);
+  ASSERT_TRUE(dag.count(h.getLeader(t)));
+  ASSERT_LE(extractor.getDAGCost(dag), extractor.getDAGCost(tree));
+}
+
+// The cost analysis runs next to constant folding and agrees with extracting
+// from scratch
+TEST(HalideTest, cost_analysis) {
+  HalideTRS h;
+  auto *t = parseHalideExpr(h, "(+ (* (+ v0 3) 4) (- (* 2 6) (* v0 4)))");
+  // 2 * 6 is folded into a constant, which is free
+  ASSERT_EQ(h.getConstant(parseHalideExpr(h, "(* 2 6)")), 12);
+  ASSERT_EQ(h.getCost(parseHalideExpr(h, "(* 2 6)")), 0);
+  saturate<HalideTRS>(getRewrites(h), h, 4);
+
+  Extractor extractor(h, getHalideCostModel());
+  std::function<CostModel::Cost(const Extractor::Result &, EClassBase *)>
+      treeCost = [&](const Extractor::Result &result, EClassBase *c) {
+        ENode *node = result.lookup(h.getLeader(c));
+        CostModel::Cost cost = extractor.costOf(node);
+        for (ClassId o : node->getOperands())
+          cost += treeCost(result, h.getClass(o));
+        return cost;
+      };
+  for (auto *c : llvm::make_range(h.class_begin(), h.class_end()))
+    ASSERT_EQ(h.getCost(c), treeCost(extractor.extract(c), c));
+  // The term of the analysis costs the same as the extracted one
+  auto result = h.extract(t);
+  ASSERT_EQ(treeCost(result, t), treeCost(extractor.extract(t), t));
+}
+
+TEST(HalideTest, congruence) {
+  HalideTRS h;
+  auto *v0 = h.var("v0");
+  auto *v1 = h.var("v1");
+  auto *a = h.sub(h.add(v0, v1), h.constant(16));
+  auto *b = h.sub(h.add(h.sub(h.add(v0, v1), h.constant(16)), h.constant(143)), h.constant(1));
+  h.eq(a, b);
+  saturate<HalideTRS>(getRewrites(h), h, 4);
+  // Every node is canonical and lives in the class the hashcons says it does
+  for (auto *c : llvm::make_range(h.class_begin(), h.class_end())) {
+    for (auto &nodes : llvm::make_second_range(c->getNodes())) {
+      for (auto *node : nodes) {
+        ASSERT_EQ(h.findNode(node->getOpcode(), node->getOperands()), node);
+        ASSERT_EQ(h.getLeaderId(node->getClassId()), c->getId());
+      }
+    }
+  }
+}
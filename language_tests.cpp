@@ -1,4 +1,5 @@
 #include "EGraph.h"
+#include "Extractor.h"
 #include "Language.h"
 #include "Pattern.h"
 #include "gtest/gtest.h"
@@ -30,3 +31,35 @@ TEST(LanguageRewriteTest, use_commute) {
   saturate<Arith>(rewrites, arith);
   ASSERT_EQ(arith.getLeader(xy), arith.getLeader(yx));
 }
+
+struct CostArith : public Language<int, CostArith>, CostAnalysis<CostArith> {
+  CostArith() : Language<int, CostArith>({"add", "mul"}) {
+    setCostModel(CostModel().setCost(getOpcode("mul"), 5));
+  }
+};
+
+REWRITE(CostArith, MulTwo, match("mul", var("x"), mConst(2)),
+        make("add", var("x"), var("x")))
+
+TEST(LanguageRewriteTest, cost_analysis) {
+  CostArith arith;
+  auto *y = arith.var("y");
+  auto *two = arith.constant(2);
+  auto *t = arith.make("mul", {arith.make("mul", {y, two}), two});
+  ASSERT_EQ(arith.getCost(t), 13);
+
+  std::vector<std::unique_ptr<Rewrite<CostArith>>> rewrites;
+  rewrites.emplace_back(new MulTwo(arith));
+  Runner<CostArith>(arith).setIterLimit(1).run(rewrites);
+  // (y + y) + (y + y)
+  ASSERT_EQ(arith.getCost(t), 7);
+  auto result = arith.extract(t);
+  ASSERT_EQ(result.lookup(arith.getLeader(t))->getOpcode(),
+            arith.getOpcode("add"));
+  ASSERT_EQ(result.size(), 3);
+
+  // Same as extracting from scratch
+  Extractor extractor(arith, CostModel().setCost(arith.getOpcode("mul"), 5));
+  ASSERT_EQ(extractor.getDAGCost(extractor.extract(t)),
+            extractor.getDAGCost(result));
+}
@@ -1,7 +1,9 @@
 #include "EGraph.h"
+#include "Extractor.h"
 #include "Pattern.h"
 #include "Language.h"
 #include "gtest/gtest.h"
+#include <set>
 
 #include "llvm/Support/raw_ostream.h"
 using llvm::errs;
@@ -46,6 +48,52 @@ TEST(MakeTest, unionfind) {
   ASSERT_TRUE(g.isEquivalent(g.getLeader(x6), g.make(9)));
 }
 
+TEST(UnionFindTest, simple) {
+  UnionFind uf;
+  for (unsigned i = 0; i < 8; i++)
+    ASSERT_EQ(uf.makeSet(), i);
+  uf.unite(0, 1);
+  uf.unite(2, 3);
+  uf.unite(1, 3);
+  uf.unite(4, 5);
+  ASSERT_EQ(uf.find(0), uf.find(3));
+  ASSERT_EQ(uf.find(4), uf.find(5));
+  ASSERT_NE(uf.find(0), uf.find(4));
+  ASSERT_NE(uf.find(6), uf.find(7));
+  // The larger set keeps its root
+  unsigned root = uf.find(0);
+  ASSERT_EQ(uf.unite(4, 0), root);
+  ASSERT_TRUE(uf.isRoot(root));
+  ASSERT_FALSE(uf.isRoot(4));
+  ASSERT_FALSE(uf.isRoot(5));
+}
+
+struct TestNode {
+  unsigned opcode;
+  std::vector<uint32_t> operands;
+  unsigned hash;
+  TestNode(unsigned opcode, std::vector<uint32_t> operands)
+      : opcode(opcode), operands(operands),
+        hash(HashCons<TestNode>::hash(opcode, operands)) {}
+  unsigned getOpcode() const { return opcode; }
+  llvm::ArrayRef<uint32_t> getOperands() const { return operands; }
+  unsigned getHash() const { return hash; }
+};
+
+TEST(HashConsTest, insert) {
+  HashCons<TestNode> table;
+  std::vector<std::unique_ptr<TestNode>> nodes;
+  for (unsigned i = 0; i < 1000; i++) {
+    nodes.emplace_back(new TestNode(i % 7, {i, i / 2}));
+    table.insert(nodes.back().get());
+  }
+  ASSERT_EQ(table.size(), 1000);
+  for (auto &node : nodes)
+    ASSERT_EQ(table.find(node->opcode, node->operands, node->hash), node.get());
+  ASSERT_EQ(table.find(7, {1, 0}, HashCons<TestNode>::hash(7, {1, 0})),
+            nullptr);
+}
+
 TEST(MakeTest, hashcons) {
   BasicEGraph g;
   ASSERT_EQ(g.make(0), g.make(0));
@@ -132,6 +180,52 @@ TEST(MakeTest, rebuild_nested2) {
   ASSERT_EQ(g.getLeader(h0), g.getLeader(h1));
 }
 
+TEST(MakeTest, rebuild_other_users) {
+  BasicEGraph g;
+  auto *x = g.make(0);
+  auto *y = g.make(1);
+  auto *a = g.make(2);
+  auto *fxy = g.make(3, {x, y});
+  // `a` stays the leader, so f(x, y) gets a new canonical node f(a, y)
+  g.merge(a, x);
+  g.rebuild();
+  // `y` is never repaired but its users still have to be canonical
+  auto *usersOfY = g.getLeader(y)->getUsersByUses(3, 1);
+  ASSERT_NE(usersOfY, nullptr);
+  ASSERT_EQ(usersOfY->size(), 1);
+  ENode *user = *usersOfY->begin();
+  ASSERT_EQ(user->getOperands()[0], g.getLeader(a)->getId());
+  ASSERT_TRUE(g.getLeader(fxy)->getNodesByOpcode(3)->count(user));
+}
+
+TEST(MakeTest, rebuild_congruent) {
+  BasicEGraph g;
+  auto *x = g.make(0);
+  auto *y = g.make(1);
+  auto *fx = g.make(2, {x});
+  auto *fy = g.make(2, {y});
+  auto *gfx = g.make(3, {fx});
+  auto *gfy = g.make(3, {fy});
+  // g(f(x)) becomes a node of the class of f(x), which is also congruent to
+  // the class of f(y)
+  g.merge(gfx, fx);
+  g.merge(x, y);
+  g.rebuild();
+  ASSERT_EQ(g.getLeader(fx), g.getLeader(fy));
+  ASSERT_EQ(g.getLeader(gfx), g.getLeader(gfy));
+  ASSERT_EQ(g.getLeader(fx), g.getLeader(gfy));
+  ASSERT_EQ(std::distance(g.class_begin(), g.class_end()), 2);
+  // Every node is canonical and lives in the class the hashcons says it does
+  for (auto *c : llvm::make_range(g.class_begin(), g.class_end())) {
+    for (auto &nodes : llvm::make_second_range(c->getNodes())) {
+      for (auto *node : nodes) {
+        ASSERT_EQ(g.findNode(node->getOpcode(), node->getOperands()), node);
+        ASSERT_EQ(g.getLeaderId(node->getClassId()), c->getId());
+      }
+    }
+  }
+}
+
 TEST(PatternTest, make) {
   auto x = Pattern::var();
   auto y = Pattern::var();
@@ -155,10 +249,8 @@ TEST(MatchTest, simple) {
   auto matches = match(pf, g);
   ASSERT_EQ(matches.size(), 1);
 
-  auto &m = matches.front();
-  llvm::DenseMap<Pattern *, EClassBase *> subst(m.begin(), m.end());
-  ASSERT_EQ(subst[px], x);
-  ASSERT_EQ(subst[py], y);
+  ASSERT_EQ(matches.lookup(0, px), x);
+  ASSERT_EQ(matches.lookup(0, py), y);
 }
 
 TEST(MatchTest, dist) {
@@ -181,12 +273,10 @@ TEST(MatchTest, dist) {
   auto *ac = Pattern::make(mul, {a, c});
   auto *p = Pattern::make(add, {ab, ac});
   auto matches = match(p, g);
-  auto &m = matches[0];
   ASSERT_EQ(matches.size(), 1);
-  llvm::DenseMap<Pattern *, EClassBase *> subst(m.begin(), m.end());
-  ASSERT_EQ(subst[a], y);
-  ASSERT_EQ(subst[b], x);
-  ASSERT_EQ(subst[c], z);
+  ASSERT_EQ(matches.lookup(0, a), y);
+  ASSERT_EQ(matches.lookup(0, b), x);
+  ASSERT_EQ(matches.lookup(0, c), z);
 }
 
 TEST(MatchTest, simple2) {
@@ -204,21 +294,78 @@ TEST(MatchTest, simple2) {
   auto matches = match(pf, g);
   ASSERT_EQ(matches.size(), 2);
 
-  auto &m0 = matches[0];
-  auto &m1 = matches[1];
-
-  llvm::DenseMap<Pattern *, EClassBase *> subst1(m0.begin(), m0.end());
-  llvm::DenseMap<Pattern *, EClassBase *> subst2(m1.begin(), m1.end());
-  if (subst1[px] == x) {
-    ASSERT_EQ(subst1[px], x);
-    ASSERT_EQ(subst1[py], y);
-    ASSERT_EQ(subst2[px], a);
-    ASSERT_EQ(subst2[py], b);
-  } else {
-    ASSERT_EQ(subst2[px], x);
-    ASSERT_EQ(subst2[py], y);
-    ASSERT_EQ(subst1[px], a);
-    ASSERT_EQ(subst1[py], b);
+  unsigned first = matches.lookup(0, px) == x ? 0 : 1;
+  ASSERT_EQ(matches.lookup(first, px), x);
+  ASSERT_EQ(matches.lookup(first, py), y);
+  ASSERT_EQ(matches.lookup(1 - first, px), a);
+  ASSERT_EQ(matches.lookup(1 - first, py), b);
+}
+
+TEST(MatchTest, buffer) {
+  auto px = Pattern::var();
+  auto pf = Pattern::make(42, {px, px});
+
+  BasicEGraph g;
+  auto x = g.make(0);
+  auto y = g.make(1);
+  auto fxx = g.make(42, {x, x});
+  auto fyy = g.make(42, {y, y});
+  g.make(42, {x, y});
+  for (auto engine : {MatchEngine::Backtracking, MatchEngine::GenericJoin}) {
+    auto matches = match(pf, g, -1, engine);
+    // One column per distinct pattern node, shared by all of the matches
+    ASSERT_EQ(matches.numColumns(), 2);
+    ASSERT_EQ(matches.size(), 2);
+    ASSERT_EQ(matches.numBindings(), 4);
+    ASSERT_EQ(matches.getColumn(Pattern::var()), -1);
+    int rootColumn = matches.getColumn(pf), varColumn = matches.getColumn(px);
+    ASSERT_NE(rootColumn, varColumn);
+    std::set<std::pair<EClassBase *, EClassBase *>> bindings;
+    for (size_t i = 0; i < matches.size(); i++)
+      bindings.emplace(matches[i][rootColumn], matches[i][varColumn]);
+    ASSERT_EQ(bindings, (std::set<std::pair<EClassBase *, EClassBase *>>{
+                            {fxx, x}, {fyy, y}}));
+  }
+}
+
+TEST(MatchTest, visitor) {
+  BasicEGraph g;
+  int n = 1000, opcode_f = n;
+  for (int i = 0; i < n; i++)
+    g.make(opcode_f, {g.make(i)});
+  auto px = Pattern::var();
+  auto pf = Pattern::make(opcode_f, {px});
+  auto pg = Pattern::make(opcode_f + 1, {px});
+
+  for (auto engine : {MatchEngine::Backtracking, MatchEngine::GenericJoin}) {
+    // Counting
+    auto matches = match(pf, g, -1, engine);
+    unsigned numMatches = 0;
+    ASSERT_TRUE(match(
+        pf, g,
+        [&](llvm::ArrayRef<Pattern *> columns,
+            llvm::ArrayRef<EClassBase *> row) {
+          EXPECT_EQ(columns, matches.getPatterns());
+          EXPECT_EQ(row, matches[numMatches]);
+          numMatches++;
+          return true;
+        },
+        engine));
+    ASSERT_EQ(numMatches, n);
+
+    // Stopping early
+    numMatches = 0;
+    ASSERT_FALSE(match(
+        pf, g,
+        [&](auto, auto) { return ++numMatches < 3; }, engine));
+    ASSERT_EQ(numMatches, 3);
+
+    // Existence: stop at the first match, if any
+    auto occurs = [&](Pattern *p) {
+      return !match(p, g, [](auto, auto) { return false; }, engine);
+    };
+    ASSERT_TRUE(occurs(pf));
+    ASSERT_FALSE(occurs(pg));
   }
 }
 
@@ -322,6 +469,146 @@ TEST(MatchTest, nonlinear) {
   }
 }
 
+TEST(MatchTest, program) {
+  auto px = Pattern::var();
+  auto py = Pattern::var();
+  auto pf = Pattern::make(42, {px, Pattern::make(43, {py, px})});
+  MatchProgram prog(pf);
+  auto insts = prog.getInstructions();
+  ASSERT_EQ(insts.size(), 4);
+  ASSERT_EQ(insts[0].pat, pf);
+  ASSERT_TRUE(insts[0].users.empty());
+  // The inner node is found through the root, and then binds both variables
+  ASSERT_EQ(insts[1].pat, pf->getOperands()[1]);
+  ASSERT_EQ(insts[1].users.size(), 1);
+  ASSERT_TRUE(insts[1].operands.empty());
+  ASSERT_EQ(insts[2].pat, px);
+  ASSERT_EQ(insts[2].users.size(), 2);
+
+  // The same program is reused as the e-graph grows
+  BasicEGraph g;
+  auto x = g.make(0);
+  auto y = g.make(1);
+  g.make(42, {x, g.make(43, {y, x})});
+  ASSERT_EQ(prog.run(g).size(), 1);
+  g.make(42, {y, g.make(43, {x, y})});
+  g.make(42, {y, g.make(43, {x, x})});
+  ASSERT_EQ(prog.run(g).size(), 2);
+  ASSERT_EQ(prog.run(g, 1).size(), 1);
+}
+
+TEST(MatchTest, chunks) {
+  BasicEGraph g;
+  int n = 1000, opcode_f = n;
+  std::vector<EClassBase *> fs;
+  for (int i = 0; i < n; i++)
+    fs.push_back(g.make(opcode_f, {g.make(i)}));
+
+  auto px = Pattern::var();
+  auto pf = Pattern::make(opcode_f, {px});
+  // The root candidates span several chunks; the matches still come out in
+  // the order of the classes
+  auto matches = match(pf, g);
+  ASSERT_EQ(matches.size(), n);
+  for (int i = 0; i < n; i++)
+    ASSERT_EQ(matches.lookup(i, pf), fs[i]);
+  ASSERT_EQ(match(pf, g, 10).size(), 10);
+  ASSERT_EQ(match(pf, g, 700).size(), 700);
+}
+
+TEST(MatchTest, deadline) {
+  BasicEGraph g;
+  int n = 1000, opcode_f = n;
+  for (int i = 0; i < n; i++)
+    g.make(opcode_f, {g.make(i)});
+
+  auto px = Pattern::var();
+  auto pf = Pattern::make(opcode_f, {px});
+  // Nothing is matched once the deadline has passed
+  auto past = std::chrono::steady_clock::now();
+  ASSERT_EQ(MatchProgram(pf).run(g, -1, 0, past).size(), 0);
+  ASSERT_EQ(matchGenericJoin(pf, g, -1, 0, past).size(), 0);
+  auto future = past + std::chrono::hours(1);
+  ASSERT_EQ(MatchProgram(pf).run(g, -1, 0, future).size(), n);
+  ASSERT_EQ(matchGenericJoin(pf, g, -1, 0, future).size(), n);
+}
+
+TEST(MatchTest, generic_join) {
+  BasicEGraph g;
+  auto a = g.make(0);
+  auto b = g.make(1);
+  int f_opcode = 100, g_opcode = 300;
+
+  g.make(f_opcode, {a, a});
+  g.make(f_opcode, {a, g.make(g_opcode, {a})});
+  g.make(f_opcode, {a, g.make(g_opcode, {b})});
+  g.make(f_opcode, {b, g.make(g_opcode, {a})});
+
+  auto x = Pattern::var();
+  auto y = Pattern::var();
+  auto p_fxy = Pattern::make(f_opcode, {x, y});
+  auto p_fxx = Pattern::make(f_opcode, {x, x});
+  auto p_gy = Pattern::make(g_opcode, {y});
+  auto p_fxgy = Pattern::make(f_opcode, {x, p_gy});
+  auto p_gx = Pattern::make(g_opcode, {x});
+  auto p_fxgx = Pattern::make(f_opcode, {x, p_gx});
+
+  // Both engines find the same substitutions
+  auto canonical = [](const MatchBuffer &matches) {
+    std::vector<std::vector<std::pair<Pattern *, EClassBase *>>> result;
+    for (size_t i = 0; i < matches.size(); i++) {
+      auto &m = result.emplace_back();
+      for (auto [pat, c] : llvm::zip(matches.getPatterns(), matches[i]))
+        m.emplace_back(pat, c);
+      llvm::sort(m);
+    }
+    llvm::sort(result);
+    return result;
+  };
+  for (auto *p : {p_fxy, p_fxx, p_fxgy, p_fxgx})
+    ASSERT_EQ(canonical(match(p, g)),
+              canonical(match(p, g, -1, MatchEngine::GenericJoin)));
+  ASSERT_EQ(match(p_fxx, g, -1, MatchEngine::GenericJoin).size(), 1);
+  ASSERT_EQ(match(p_fxgy, g, -1, MatchEngine::GenericJoin).size(), 3);
+  ASSERT_EQ(match(p_fxgx, g, -1, MatchEngine::GenericJoin).size(), 1);
+  ASSERT_EQ(match(p_fxy, g, 2, MatchEngine::GenericJoin).size(), 2);
+}
+
+TEST(MatchTest, since) {
+  BasicEGraph g;
+  auto x = g.make(0);
+  auto y = g.make(1);
+  auto z = g.make(2);
+  g.make(42, {x, y});
+
+  auto px = Pattern::var();
+  auto py = Pattern::var();
+  auto pf = Pattern::make(42, {px, py});
+  unsigned since = g.advanceEpoch();
+  for (auto engine : {MatchEngine::Backtracking, MatchEngine::GenericJoin}) {
+    ASSERT_EQ(match(pf, g, -1, engine).size(), 1);
+    ASSERT_EQ(match(pf, g, -1, engine, since).size(), 0);
+  }
+
+  // A new node shows up
+  auto fyz = g.make(42, {y, z});
+  for (auto engine : {MatchEngine::Backtracking, MatchEngine::GenericJoin}) {
+    auto matches = match(pf, g, -1, engine, since);
+    ASSERT_EQ(matches.size(), 1);
+    ASSERT_EQ(matches.lookup(0, pf), fyz);
+  }
+
+  // An old class is merged into
+  since = g.advanceEpoch();
+  g.merge(x, z);
+  g.rebuild();
+  for (auto engine : {MatchEngine::Backtracking, MatchEngine::GenericJoin})
+    ASSERT_EQ(match(pf, g, -1, engine, since).size(), 2);
+  since = g.advanceEpoch();
+  for (auto engine : {MatchEngine::Backtracking, MatchEngine::GenericJoin})
+    ASSERT_EQ(match(pf, g, -1, engine, since).size(), 0);
+}
+
 template<typename EGraphT>
 struct Commute : public Rewrite<EGraphT> {
   Pattern *x, *y;
@@ -375,6 +662,18 @@ struct Distribute : public Rewrite<EGraphT> {
   }
 };
 
+// (x + y) * z => x * z + y * z with the right-hand side as a pattern
+template<typename EGraphT>
+struct DistributePattern : public Rewrite<EGraphT> {
+  DistributePattern(Opcode add, Opcode mul) {
+    auto *x = this->var();
+    auto *y = this->var();
+    auto *z = this->var();
+    this->root = this->match(mul, this->match(add, x, y), z);
+    this->rhs = this->match(add, this->match(mul, x, z), this->match(mul, y, z));
+  }
+};
+
 TEST(RewriteTest, commute) {
   BasicEGraph g;
   int add = 100;
@@ -432,6 +731,208 @@ TEST(RewriteTest, ab) {
   ASSERT_EQ(g.getLeader(a_bc), g.getLeader(ac_plus_ab));
 }
 
+TEST(RewriteTest, rhs_pattern) {
+  BasicEGraph g;
+  int add = 100, mul = 200;
+  auto a = g.make(0);
+  auto b = g.make(1);
+  auto c = g.make(2);
+  auto ab_c = g.make(mul, {g.make(add, {a, b}), c});
+  auto ac_bc = g.make(add, {g.make(mul, {a, c}), g.make(mul, {b, c})});
+
+  DistributePattern<BasicEGraph> distribute(add, mul);
+  // z is used twice but bound once
+  RHSProgram program(distribute.targetPattern());
+  ASSERT_EQ(program.getInstructions().size(), 3);
+  ASSERT_EQ(program.getInstructions().back().opcode, add);
+
+  auto matches = match(distribute.sourcePattern(), g);
+  ASSERT_EQ(matches.size(), 1);
+  // The variables are found wherever the matcher put them
+  auto patterns = matches.getPatterns();
+  MatchBuffer reversed({patterns.rbegin(), patterns.rend()});
+  std::vector<EClassBase *> row(matches[0].rbegin(), matches[0].rend());
+  reversed.push_back(row);
+  distribute.applyMatches(reversed, g);
+  g.rebuild();
+  ASSERT_EQ(g.getLeader(ab_c), g.getLeader(ac_bc));
+}
+
+TEST(SchedulerTest, backoff) {
+  BackoffScheduler scheduler(2, 3);
+  scheduler.reset(2);
+  ASSERT_TRUE(scheduler.shouldMatch(0, 0));
+  // Look for one match more than the threshold to tell if it's exceeded
+  ASSERT_EQ(scheduler.getMatchLimit(0, 0), 3);
+
+  // The threshold counts matches, not the classes they bind
+  Pattern *x = Pattern::var(), *y = Pattern::var();
+  MatchBuffer matches({x, y});
+  matches.push_back({nullptr, nullptr});
+  matches.push_back({nullptr, nullptr});
+  ASSERT_TRUE(scheduler.shouldApply(1, 0, matches));
+  matches.push_back({nullptr, nullptr});
+  ASSERT_FALSE(scheduler.shouldApply(0, 0, matches));
+  // Banned for 3 iterations, with the threshold doubled afterwards
+  ASSERT_FALSE(scheduler.shouldMatch(0, 1));
+  ASSERT_FALSE(scheduler.shouldMatch(0, 2));
+  ASSERT_TRUE(scheduler.shouldMatch(1, 1));
+  ASSERT_TRUE(scheduler.shouldMatch(0, 3));
+  ASSERT_TRUE(scheduler.shouldMatch(0, 100));
+  ASSERT_EQ(scheduler.getMatchLimit(0, 3), 5);
+
+  // The next ban is twice as long, unless we'd otherwise stop
+  matches.push_back({nullptr, nullptr});
+  matches.push_back({nullptr, nullptr});
+  ASSERT_FALSE(scheduler.shouldApply(0, 3, matches));
+  ASSERT_FALSE(scheduler.shouldMatch(0, 8));
+  ASSERT_FALSE(scheduler.canStop(4));
+  ASSERT_TRUE(scheduler.shouldMatch(0, 5));
+  ASSERT_TRUE(scheduler.canStop(5));
+
+  // A ban that runs out right after the iteration still blocks stopping, as
+  // the rule was skipped in it
+  BackoffScheduler scheduler2(2, 2);
+  scheduler2.reset(1);
+  ASSERT_FALSE(scheduler2.shouldApply(0, 0, matches));
+  ASSERT_FALSE(scheduler2.shouldMatch(0, 1));
+  ASSERT_FALSE(scheduler2.canStop(1));
+  ASSERT_TRUE(scheduler2.shouldMatch(0, 2));
+  ASSERT_TRUE(scheduler2.canStop(2));
+}
+
+namespace {
+// Opcode 0 costs 10, everything else costs 1
+struct ExpensiveLeafExtractor : public Extractor {
+  ExpensiveLeafExtractor(EGraphBase &g)
+      : Extractor(g, CostModel().setCost(0, 10)) {}
+};
+} // namespace
+
+TEST(ExtractorTest, cycle) {
+  BasicEGraph g;
+  // x = f(x)
+  auto *x = g.make(0);
+  auto *fx = g.make(1, {x});
+  g.merge(x, fx);
+  g.rebuild();
+  // The cheap node is circular, so we have to pick the expensive leaf
+  auto result = ExpensiveLeafExtractor(g).extract(x);
+  ASSERT_EQ(result.size(), 1);
+  ASSERT_EQ(result.lookup(g.getLeader(x))->getOpcode(), 0);
+}
+
+TEST(ExtractorTest, shared) {
+  BasicEGraph g;
+  // g(y, y) where y = x = f(f(z))
+  auto *x = g.make(0);
+  auto *z = g.make(2);
+  auto *y = g.make(1, {g.make(1, {z})});
+  auto *root = g.make(3, {y, y});
+  g.merge(x, y);
+  g.rebuild();
+  auto result = ExpensiveLeafExtractor(g).extract(root);
+  ASSERT_EQ(result.size(), 4);
+  ASSERT_EQ(result.lookup(g.getLeader(root))->getOpcode(), 3);
+  ASSERT_EQ(result.lookup(g.getLeader(y))->getOpcode(), 1);
+  ASSERT_EQ(result.lookup(g.getLeader(z))->getOpcode(), 2);
+}
+
+TEST(ExtractorTest, cost_model) {
+  BasicEGraph g;
+  // x = f(g(y, z)) | h(y)
+  auto *y = g.make(0);
+  auto *z = g.make(1);
+  auto *x = g.make(2, {g.make(3, {y, z})});
+  g.merge(x, g.make(4, {y}));
+  g.rebuild();
+  ASSERT_EQ(Extractor(g).extract(x).lookup(g.getLeader(x))->getOpcode(), 4);
+
+  // AST size 3 (depth 2) vs. 4 (depth 3)
+  CostModel model = CostModel::astDepth();
+  ASSERT_EQ(Extractor(g, model).extract(x).lookup(g.getLeader(x))->getOpcode(),
+            4);
+
+  // The cost of h depends on the node
+  int numCalls = 0;
+  model = CostModel().setCost(4, [&](const ENode *node) {
+    numCalls++;
+    return 10 * node->getOperands().size();
+  });
+  Extractor extractor(g, model);
+  auto result = extractor.extract(x);
+  ASSERT_GT(numCalls, 0);
+  ASSERT_EQ(result.lookup(g.getLeader(x))->getOpcode(), 2);
+  ASSERT_EQ(extractor.getDAGCost(result), 4);
+}
+
+TEST(ExtractorTest, batch) {
+  BasicEGraph g;
+  // f(s) and h(s, t), with t = g(s)
+  auto *s = g.make(1);
+  auto *t = g.make(0);
+  auto *fs = g.make(2, {s});
+  auto *hst = g.make(3, {s, t});
+  g.merge(t, g.make(4, {s}));
+  g.rebuild();
+
+  ExpensiveLeafExtractor extractor(g);
+  auto result = extractor.extract({fs, hst});
+  ASSERT_EQ(result.size(), 4);
+  for (auto *c : {fs, hst}) {
+    for (auto [cls, node] : extractor.extract(c))
+      ASSERT_EQ(result.lookup(cls), node);
+  }
+  ASSERT_EQ(result.lookup(g.getLeader(t))->getOpcode(), 4);
+}
+
+TEST(ExtractorTest, dag) {
+  BasicEGraph g;
+  // A chain of `n` nodes with fresh opcodes from `opcode` on
+  auto chain = [&](Opcode opcode, unsigned n) {
+    auto *c = g.make(opcode);
+    for (unsigned i = 1; i < n; i++)
+      c = g.make(opcode + i, {c});
+    return c;
+  };
+  // root = r(a, b), where a = f(s) = chain1 and b = h(s) = chain2. The
+  // chains are cheaper trees, but sharing s makes the DAG cheaper.
+  auto *s = g.make(0);
+  auto *a = g.make(1, {s});
+  auto *b = g.make(2, {s});
+  auto *root = g.make(3, {a, b});
+  g.merge(a, chain(100, 8));
+  g.merge(b, chain(200, 8));
+  g.rebuild();
+
+  ExpensiveLeafExtractor extractor(g);
+  auto tree = extractor.extract(root);
+  ASSERT_EQ(extractor.getDAGCost(tree), 17);
+  ASSERT_EQ(tree.lookup(g.getLeader(a))->getOpcode(), 107);
+
+  auto dag = extractor.extractDAG(root);
+  ASSERT_EQ(extractor.getDAGCost(dag), 13);
+  ASSERT_EQ(dag.size(), 4);
+  ASSERT_EQ(dag.lookup(g.getLeader(a))->getOpcode(), 1);
+  ASSERT_EQ(dag.lookup(g.getLeader(b))->getOpcode(), 2);
+
+  // Without time to search we fall back to the tree-cost result
+  ASSERT_EQ(extractor.extractDAG(root, 0), tree);
+}
+
+TEST(ExtractorTest, dag_cycle) {
+  BasicEGraph g;
+  // x = f(y), y = g(x) | leaf
+  auto *y = g.make(0);
+  auto *x = g.make(1, {y});
+  g.merge(y, g.make(2, {x}));
+  g.rebuild();
+  // g(x) is cheaper than the leaf but makes a cycle
+  auto result = ExpensiveLeafExtractor(g).extractDAG(x);
+  ASSERT_EQ(result.size(), 2);
+  ASSERT_EQ(result.lookup(g.getLeader(y))->getOpcode(), 0);
+}
+
 TEST(LanguageTest, variables) {
   Language<int, BasicEGraph> l({});
   ASSERT_TRUE(l.isEquivalent(l.var("x"), l.var("x")));